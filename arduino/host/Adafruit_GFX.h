@@ -0,0 +1,11 @@
+/**
+ * Adafruit_GFX.h
+ * Host stand-in, see Adafruit_LEDBackpack.h
+ */
+
+#ifndef ADAFRUIT_GFX_H
+#define ADAFRUIT_GFX_H
+
+#include "Arduino.h"
+
+#endif
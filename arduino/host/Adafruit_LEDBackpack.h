@@ -0,0 +1,85 @@
+/**
+ * Adafruit_LEDBackpack.h
+ * Host stand-in for the 7-segment backpack. It keeps the digits as
+ * characters rather than segment bits, and hands the display to
+ * board_display_written() whenever the sketch sends it to the HT16K33
+ */
+
+#ifndef ADAFRUIT_LEDBACKPACK_H
+#define ADAFRUIT_LEDBACKPACK_H
+
+#include "Arduino.h"
+
+// 100kHz I2C: 8 data bits and an ack per byte, which Wire waits out
+#define I2C_BYTE_CYCLES (9 * F_CPU / 100000)
+
+// address, then the command or the display RAM address and 16 bytes of RAM
+#define HT16K33_COMMAND_BYTES 2
+#define HT16K33_DISPLAY_BYTES 18
+
+// positions 0, 1, 3 and 4 are digits and 2 is the colon
+#define SEVEN_SEGMENT_POSITIONS 5
+#define SEVEN_SEGMENT_COLON 2
+
+struct Adafruit_7segment;
+
+void board_display_written(const Adafruit_7segment *display);
+
+struct Adafruit_7segment {
+  char digits[SEVEN_SEGMENT_POSITIONS];
+  bool dots[SEVEN_SEGMENT_POSITIONS];
+  bool colon;
+  uint8_t brightness;
+
+  Adafruit_7segment() : digits{' ', ' ', ' ', ' ', ' '}, dots{}, colon(false), brightness(15) {}
+
+  void begin(uint8_t) {
+    // oscillator on, display on, full brightness
+    board_spend(3 * HT16K33_COMMAND_BYTES * I2C_BYTE_CYCLES);
+  }
+
+  void setBrightness(uint8_t b) {
+    brightness = b > 15 ? 15 : b;
+    board_spend(HT16K33_COMMAND_BYTES * I2C_BYTE_CYCLES);
+  }
+
+  void writeDisplay() {
+    board_spend(HT16K33_DISPLAY_BYTES * I2C_BYTE_CYCLES);
+    board_display_written(this);
+  }
+
+  void clear() {
+    memset(digits, ' ', sizeof(digits));
+    memset(dots, 0, sizeof(dots));
+    colon = false;
+  }
+
+  void drawColon(bool state) {
+    colon = state;
+  }
+
+  void writeDigitNum(uint8_t d, uint8_t num, bool dot = false) {
+    if (d >= SEVEN_SEGMENT_POSITIONS || d == SEVEN_SEGMENT_COLON) {
+      return;
+    }
+
+    // the real number table stops at 0xF, past that is garbage
+    digits[d] = num < 16 ? "0123456789ABCDEF"[num] : '?';
+    dots[d] = dot;
+  }
+
+  /* right aligned, blanking the unused digits */
+  void print(unsigned long n, int base = DEC) {
+    for (int d = SEVEN_SEGMENT_POSITIONS - 1; d >= 0; d--) {
+      if (d == SEVEN_SEGMENT_COLON) {
+        continue;
+      }
+
+      digits[d] = n > 0 || d == SEVEN_SEGMENT_POSITIONS - 1 ? "0123456789ABCDEF"[n % base] : ' ';
+      dots[d] = false;
+      n /= base;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,231 @@
+/**
+ * Arduino.h
+ * Host stand-in for the parts of the Arduino core which leds.ino uses, so
+ * the sketch can be built into a Linux program (see emulator.cpp).
+ *
+ * The sketch runs against a simulated clock, board_ns. The core calls move
+ * it on by roughly the cycles they take on a 16MHz ATmega328P, which are
+ * also totalled in board_cycles, and every pin change is counted in
+ * pin_toggles. The sketch's own code is free, but it is cheap next to the
+ * I/O. The program the sketch is built into supplies the board_* hooks
+ * declared below
+ */
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define DEC 10
+#define HEX 16
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define _BV(bit) (1 << (bit))
+
+#define NUM_DIGITAL_PINS 20
+
+// what the Uno's core gives us
+#define SERIAL_RX_BUFFER_SIZE 64
+#define SERIAL_RX_BUFFER_MAX 1024
+
+#define F_CPU 16000000UL
+
+// approximate costs on the board, in CPU cycles
+#define DIGITAL_WRITE_CYCLES 56     // pin lookups, PWM timer check and the write
+#define SHIFT_OUT_BIT_CYCLES 12     // shiftOut()'s own work per bit
+#define SERIAL_AVAILABLE_CYCLES 12
+#define SERIAL_READ_CYCLES 28
+#define SERIAL_WRITE_CYCLES 40
+#define SERIAL_RX_ISR_CYCLES 70     // the USART interrupt storing a received byte
+#define LOOP_CYCLES 24              // main() calling loop() and serialEventRun()
+
+// simulated time, ns, and the CPU cycles spent so far
+inline unsigned long long board_ns = 0;
+inline unsigned long long board_cycles = 0;
+
+inline uint8_t pin_modes[NUM_DIGITAL_PINS];
+inline uint8_t pin_levels[NUM_DIGITAL_PINS];
+inline unsigned long pin_toggles[NUM_DIGITAL_PINS];
+
+// the ports which SHIFT_DRIVER_PORT writes; nothing watches these
+inline volatile uint8_t PORTB, PORTD;
+
+/*
+ * Hooks into the program the sketch is built into
+ */
+void board_pin_changed(uint8_t pin, uint8_t level);
+void board_serial_write(uint8_t value);
+void board_serial_flush();
+
+inline void board_spend(unsigned long long cycles) {
+  board_cycles += cycles;
+  board_ns += cycles * 1000 / (F_CPU / 1000000);
+}
+
+inline unsigned long millis() {
+  return board_ns / 1000000;
+}
+
+inline unsigned long micros() {
+  return board_ns / 1000;
+}
+
+inline void delay(unsigned long ms) {
+  board_spend((unsigned long long)ms * (F_CPU / 1000));
+}
+
+inline void delayMicroseconds(unsigned int us) {
+  board_spend((unsigned long long)us * (F_CPU / 1000000));
+}
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < NUM_DIGITAL_PINS) {
+    pin_modes[pin] = mode;
+  }
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t level) {
+  board_spend(DIGITAL_WRITE_CYCLES);
+
+  if (pin >= NUM_DIGITAL_PINS) {
+    return;
+  }
+
+  level = level ? HIGH : LOW;
+
+  if (pin_levels[pin] != level) {
+    pin_levels[pin] = level;
+    pin_toggles[pin]++;
+    board_pin_changed(pin, level);
+  }
+}
+
+inline int digitalRead(uint8_t pin) {
+  return pin < NUM_DIGITAL_PINS ? pin_levels[pin] : LOW;
+}
+
+/* same as wiring_shift.c */
+inline void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val) {
+  for (uint8_t i = 0; i < 8; i++) {
+    board_spend(SHIFT_OUT_BIT_CYCLES);
+
+    if (bitOrder == LSBFIRST) {
+      digitalWrite(dataPin, !!(val & (1 << i)));
+    }
+    else {
+      digitalWrite(dataPin, !!(val & (1 << (7 - i))));
+    }
+
+    digitalWrite(clockPin, HIGH);
+    digitalWrite(clockPin, LOW);
+  }
+}
+
+/*
+ * The UART. The host program puts received bytes into the RX ring with
+ * receive(), which drops them when it is full like the real interrupt
+ * handler does. Everything written goes to board_serial_write()
+ */
+struct HardwareSerial {
+  unsigned long baud;
+  int rx_size;
+  uint8_t rx[SERIAL_RX_BUFFER_MAX];
+  int rx_head;
+  int rx_count;
+
+  void begin(unsigned long rate) {
+    baud = rate;
+  }
+
+  void end() {
+    rx_head = 0;
+    rx_count = 0;
+  }
+
+  bool receive(uint8_t value) {
+    board_spend(SERIAL_RX_ISR_CYCLES);
+
+    if (rx_count == rx_size) {
+      return false;
+    }
+
+    rx[(rx_head + rx_count) % rx_size] = value;
+    rx_count++;
+
+    return true;
+  }
+
+  int available() {
+    board_spend(SERIAL_AVAILABLE_CYCLES);
+    return rx_count;
+  }
+
+  int peek() {
+    return rx_count > 0 ? rx[rx_head] : -1;
+  }
+
+  int read() {
+    if (rx_count == 0) {
+      return -1;
+    }
+
+    board_spend(SERIAL_READ_CYCLES);
+
+    const uint8_t value = rx[rx_head];
+    rx_head = (rx_head + 1) % rx_size;
+    rx_count--;
+
+    return value;
+  }
+
+  void flush() {
+    board_serial_flush();
+  }
+
+  size_t write(uint8_t value) {
+    board_spend(SERIAL_WRITE_CYCLES);
+    board_serial_write(value);
+    return 1;
+  }
+
+  size_t write(const uint8_t *buf, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+      write(buf[i]);
+    }
+    return length;
+  }
+
+  size_t print(const char *str) {
+    return write((const uint8_t *)str, strlen(str));
+  }
+
+  size_t print(long value, int base = DEC) {
+    char buf[24];
+    snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%ld", value);
+    return print(buf);
+  }
+
+  size_t println(const char *str = "") {
+    return print(str) + print("\r\n");
+  }
+};
+
+inline HardwareSerial Serial = { 0, SERIAL_RX_BUFFER_SIZE, {}, 0, 0 };
+
+#endif
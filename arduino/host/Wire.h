@@ -0,0 +1,11 @@
+/**
+ * Wire.h
+ * Host stand-in. The sketch only talks I2C through Adafruit_7segment
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include "Arduino.h"
+
+#endif
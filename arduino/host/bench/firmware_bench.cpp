@@ -0,0 +1,186 @@
+/**
+ * Benchmark for leds.ino, built for the host against the stand-ins in
+ * arduino/host. Times the sketch's hot functions, then replays serial
+ * streams captured with the emulator (--capture) through loop(), and
+ * reports host time, simulated AVR cycles and pin toggles for each.
+ *
+ * Cycles only cover what the stand-ins charge for (see Arduino.h), which
+ * is the I/O the sketch spends nearly all of its time in
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Adafruit_LEDBackpack.h"
+
+#include "../../leds/leds.ino"
+
+#if SHIFT_DRIVER != SHIFT_DRIVER_SHIFTOUT
+#error "The stand-ins only count SHIFT_DRIVER_SHIFTOUT"
+#endif
+
+#define ITERATIONS_FUNCTION 200000
+#define ITERATIONS_STREAM 20
+#define STREAM_BUFFER (16 * 1024 * 1024)
+
+#define LINE_BYTES_PER_SECOND 100000  // 1000000 baud, 10 bits a byte
+
+long led_frames = 0;
+long display_frames = 0;
+long bytes_sent = 0;
+
+void board_pin_changed(uint8_t pin, uint8_t level) {
+  // the second chain latches last
+  if (pin == lp2 && level == HIGH) {
+    led_frames++;
+  }
+}
+
+void board_serial_write(uint8_t) {
+  bytes_sent++;
+}
+
+void board_serial_flush() {}
+
+void board_display_written(const Adafruit_7segment *) {
+  display_frames++;
+}
+
+long long monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+unsigned long total_toggles() {
+  unsigned long toggles = 0;
+
+  for (int pin = 0; pin < NUM_DIGITAL_PINS; pin++) {
+    toggles += pin_toggles[pin];
+  }
+
+  return toggles;
+}
+
+/*
+ * Counters at the start of a run, to report the difference from
+ */
+struct bench_start {
+  long long ns;
+  unsigned long long cycles;
+  unsigned long toggles;
+  long frames;
+};
+
+bench_start begin_run() {
+  return { monotonic_ns(), board_cycles, total_toggles(), led_frames + display_frames };
+}
+
+void report(const char *name, const bench_start *start, int iterations) {
+  printf("%-24s %10.1f ns/op %10.1f cycles/op %8.1f toggles/op\n",
+    name,
+    (double)(monotonic_ns() - start->ns) / iterations,
+    (double)(board_cycles - start->cycles) / iterations,
+    (double)(total_toggles() - start->toggles) / iterations);
+}
+
+/*
+ * Feed a stream to the sketch a byte at a time, running loop() until it
+ * has dealt with each one, as it would when keeping up with the line
+ */
+void replay(const uint8_t *stream, long length) {
+  for (long i = 0; i < length; i++) {
+    Serial.receive(stream[i]);
+
+    while (Serial.available() > 0) {
+      loop();
+      board_spend(LOOP_CYCLES);
+    }
+  }
+}
+
+void bench_stream(const char *path, uint8_t *buf) {
+  FILE *fp = fopen(path, "rb");
+
+  if (!fp) {
+    printf("Error reading %s!\n", path);
+    exit(1);
+  }
+
+  const long length = fread(buf, 1, STREAM_BUFFER, fp);
+  fclose(fp);
+
+  if (length == 0) {
+    printf("%s is empty!\n", path);
+    return;
+  }
+
+  const bench_start start = begin_run();
+
+  for (int i = 0; i < ITERATIONS_STREAM; i++) {
+    replay(buf, length);
+  }
+
+  const double bytes = (double)length * ITERATIONS_STREAM;
+  const double frames = led_frames + display_frames - start.frames;
+  const double cycles = board_cycles - start.cycles;
+  const double cycles_per_byte = cycles / bytes;
+
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+
+  // what limits the frame rate: the sketch, or getting the bytes to it
+  printf("%-24s %8ld bytes %6.0f frames %8.1f ns/byte %8.1f cycles/byte %8.1f cycles/frame %6.1f toggles/frame, max %.0f frames/s (CPU) %.0f (1Mbaud line)\n",
+    name,
+    length,
+    frames / ITERATIONS_STREAM,
+    (monotonic_ns() - start.ns) / bytes,
+    cycles_per_byte,
+    frames > 0 ? cycles / frames : 0,
+    frames > 0 ? (total_toggles() - start.toggles) / frames : 0,
+    cycles > 0 ? frames * F_CPU / cycles : 0,
+    frames > 0 ? frames * LINE_BYTES_PER_SECOND / bytes : 0);
+}
+
+int main(int argc, char *argv[]) {
+  Serial.rx_size = SERIAL_RX_BUFFER_SIZE;
+
+  setup();
+
+  bench_start start;
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_FUNCTION; i++) toggleLed(i % numLeds, i & 1);
+  report("toggleLed", &start, ITERATIONS_FUNCTION);
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_FUNCTION; i++) {
+    led[i & 3] ^= 1 << (i % 7);
+    updateShiftRegister();
+  }
+  report("updateShiftRegister", &start, ITERATIONS_FUNCTION);
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_FUNCTION; i++) {
+    ledBack[i & 3] ^= 1 << (i % 7);
+    latchLeds();
+  }
+  report("latchLeds", &start, ITERATIONS_FUNCTION);
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_FUNCTION; i++) loop();
+  report("loop (idle)", &start, ITERATIONS_FUNCTION);
+
+  uint8_t *buf = (uint8_t *)malloc(STREAM_BUFFER);
+
+  for (int i = 1; i < argc; i++) {
+    bench_stream(argv[i], buf);
+  }
+
+  free(buf);
+
+  return 0;
+}
@@ -0,0 +1,670 @@
+/**
+ * emulator.cpp
+ * Runs leds.ino on a pseudo-terminal, so ledseq can be run and benchmarked
+ * without a board:
+ *
+ *   ./emulator --link=/tmp/ttyLEDS --log=frames.txt &
+ *   ../../ledseq/ledseq /tmp/ttyLEDS pong
+ *
+ * The serial line is modelled on top of the pty: bytes take 10 bit times
+ * at the baud rate both ends are set to (bytes sent at the wrong rate are
+ * lost, like framing errors), and land in the sketch's 64 byte RX buffer,
+ * which drops them when the sketch has fallen behind. The sketch runs on
+ * a simulated clock (see Arduino.h) which is kept in step with real time.
+ *
+ * Like the board, the sketch is reset whenever the port is opened: each
+ * session runs in a fresh child process. Every frame which reaches the
+ * shift registers or the display is logged with its time and latency, and
+ * each session ends with a throughput and latency summary. Everything the
+ * host sends can also be captured, to replay through bench/firmware_bench
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+#include "Adafruit_LEDBackpack.h"
+
+#include "../leds/leds.ino"
+
+#if SHIFT_DRIVER != SHIFT_DRIVER_SHIFTOUT
+#error "The emulator only models SHIFT_DRIVER_SHIFTOUT"
+#endif
+
+#define LINE_BITS 10            // start bit, 8 data bits, stop bit
+#define WIRE_BUFFER 4096        // what the host's tty buffers before write() blocks
+#define TX_BUFFER 64            // the sketch's TX buffer, Serial.write() waits when full
+#define BOOT_DELAY 100000000    // ns, time in the bootloader after a reset
+#define IDLE_WAIT 10000000      // ns, longest wait while the sketch is idle
+#define MAX_AHEAD 20000         // ns the sketch may run ahead of real time before it waits
+#define OPEN_POLL_INTERVAL 20   // ms, how often to check whether the port was opened
+
+/*
+ * See ledseq.cpp: glibc's <termios.h> can't tell us about the arbitrary
+ * baud rates which the host sets with TCSETS2
+ */
+struct termios2 {
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
+
+/*
+ * A byte on its way between the host and the sketch, sent at baud and
+ * arriving at the far end at time due (ns)
+ */
+struct line_byte {
+  uint8_t value;
+  unsigned long baud;
+  long long sent;
+  long long due;
+};
+
+/*
+ * One direction of the serial line: a FIFO of bytes in flight
+ */
+struct line {
+  line_byte *bytes;
+  int size;
+  int head;
+  int count;
+  long long free_at;    // when the last byte finishes arriving
+};
+
+/*
+ * One 74HC595 chain. The first byte shifted in (LSB first) ends up in the
+ * second IC, so after 16 clocks the chain holds
+ * reverse(led[first]) << 8 | reverse(led[first + 1])
+ */
+struct shift_chain {
+  int data_pin;
+  int clock_pin;
+  int latch_pin;
+  int first;            // the led[] group in the first IC
+  uint16_t shift;
+  uint16_t outputs;
+};
+
+struct session_stats {
+  long led_frames;
+  long display_frames;
+  long rx_bytes;
+  long tx_bytes;
+  long overruns;        // dropped because the RX buffer was full
+  long framing_errors;  // sent at a different baud rate to the receiver's
+  long long latency_total;
+  long long latency_min;
+  long long latency_max;
+  long latencies;
+};
+
+const char *log_path = NULL;
+const char *link_path = NULL;
+const char *capture_path = NULL;
+int rx_buffer_size = SERIAL_RX_BUFFER_SIZE;
+
+volatile sig_atomic_t stopping = 0;
+
+int master = -1;
+long long session_start;
+FILE *frame_log = NULL;
+FILE *capture = NULL;
+
+line rx_line;
+line tx_line;
+line_byte rx_bytes[WIRE_BUFFER];
+line_byte tx_bytes[TX_BUFFER];
+
+// when each byte put into the RX buffer was sent, to work out latencies
+long long rx_sent[SERIAL_RX_BUFFER_MAX];
+long rx_delivered = 0;
+
+shift_chain chains[2];
+session_stats stats;
+
+void stop_running(int) {
+  stopping = 1;
+}
+
+/* ns since the session started */
+long long elapsed_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec - session_start;
+}
+
+/* the host's baud rate, 0 if it can't be read */
+unsigned long host_baud() {
+  struct termios2 tty;
+
+  if (ioctl(master, TCGETS2, &tty) != 0) {
+    return 0;
+  }
+
+  return tty.c_ospeed;
+}
+
+/*
+ * Queue a byte on a line, after whatever is already on it
+ */
+void line_send(line *l, uint8_t value, unsigned long baud, long long now) {
+  const long long start = l->free_at > now ? l->free_at : now;
+  line_byte *b = &l->bytes[(l->head + l->count) % l->size];
+
+  b->value = value;
+  b->baud = baud;
+  b->sent = now;
+  b->due = start + (baud > 0 ? LINE_BITS * 1000000000LL / baud : 0);
+
+  l->free_at = b->due;
+  l->count++;
+}
+
+line_byte *line_arrived(line *l, long long now) {
+  if (l->count == 0 || l->bytes[l->head].due > now) {
+    return NULL;
+  }
+
+  line_byte *b = &l->bytes[l->head];
+  l->head = (l->head + 1) % l->size;
+  l->count--;
+
+  return b;
+}
+
+/*
+ * Move the bytes which have arrived by now into the sketch's RX buffer
+ */
+void receive(long long now) {
+  line_byte *b;
+
+  while ((b = line_arrived(&rx_line, now))) {
+    if (b->baud != Serial.baud) {
+      stats.framing_errors++;
+    }
+    else if (!Serial.receive(b->value)) {
+      stats.overruns++;
+    }
+    else {
+      rx_sent[rx_delivered++ % SERIAL_RX_BUFFER_MAX] = b->sent;
+      stats.rx_bytes++;
+    }
+  }
+}
+
+/*
+ * Pass the bytes which have arrived by now on to the host
+ */
+void transmit(long long now) {
+  line_byte *b;
+
+  while ((b = line_arrived(&tx_line, now))) {
+    if (b->baud != host_baud()) {
+      stats.framing_errors++;
+    }
+    else if (write(master, &b->value, 1) == 1) {
+      stats.tx_bytes++;
+    }
+  }
+}
+
+void board_serial_write(uint8_t value) {
+  if (tx_line.count == tx_line.size) {
+    // wait for room, like HardwareSerial::write()
+    board_ns = tx_line.bytes[tx_line.head].due;
+    transmit(board_ns);
+  }
+
+  line_send(&tx_line, value, Serial.baud, board_ns);
+}
+
+void board_serial_flush() {
+  if (tx_line.free_at > (long long)board_ns) {
+    board_ns = tx_line.free_at;
+  }
+
+  transmit(board_ns);
+}
+
+/*
+ * Take whatever the host has written, as long as the line has room
+ */
+void read_host(long long now) {
+  uint8_t buf[WIRE_BUFFER];
+  const int room = rx_line.size - rx_line.count;
+
+  if (room == 0) {
+    return;
+  }
+
+  const int bytes_read = read(master, buf, room);
+
+  if (bytes_read <= 0) {
+    return;
+  }
+
+  if (capture) {
+    fwrite(buf, 1, bytes_read, capture);
+  }
+
+  const unsigned long baud = host_baud();
+
+  for (int i = 0; i < bytes_read; i++) {
+    line_send(&rx_line, buf[i], baud, now);
+  }
+}
+
+/*
+ * Keep reading from the host until real time reaches deadline, or when
+ * the sketch is idle, until there is something on the line for it. With
+ * a deadline which has passed, this just picks up whatever the host has
+ * written. Returns false once the host has closed the port
+ */
+bool wait_until(long long deadline, bool idle) {
+  for (;;) {
+    const long long now = elapsed_ns();
+
+    transmit(now);
+
+    // wake up for the next reply to go out, too
+    long long wake = deadline;
+
+    if (tx_line.count > 0 && tx_line.bytes[tx_line.head].due < wake) {
+      wake = tx_line.bytes[tx_line.head].due;
+    }
+
+    struct pollfd pfd = { master, (short)(rx_line.count < rx_line.size ? POLLIN : 0), 0 };
+    const long long timeout_ns = wake > now ? wake - now : 0;
+    const struct timespec timeout = {
+      (time_t)(timeout_ns / 1000000000),
+      (long)(timeout_ns % 1000000000)
+    };
+
+    if (ppoll(&pfd, 1, &timeout, NULL) > 0) {
+      if (pfd.revents & POLLIN) {
+        read_host(elapsed_ns());
+      }
+      else if (pfd.revents & (POLLHUP | POLLERR)) {
+        return false;
+      }
+    }
+
+    if (stopping) {
+      return false;
+    }
+
+    if (elapsed_ns() >= deadline || (idle && rx_line.count > 0)) {
+      return true;
+    }
+  }
+}
+
+/*
+ * How long ago the byte which finished the frame was sent. Frames the
+ * sketch shows by itself (at boot) don't count
+ */
+long long record_latency() {
+  const long consumed = rx_delivered - Serial.available();
+
+  if (consumed == 0) {
+    return 0;
+  }
+
+  const long long latency = (long long)board_ns - rx_sent[(consumed - 1) % SERIAL_RX_BUFFER_MAX];
+
+  if (stats.latencies == 0 || latency < stats.latency_min) {
+    stats.latency_min = latency;
+  }
+  if (latency > stats.latency_max) {
+    stats.latency_max = latency;
+  }
+
+  stats.latency_total += latency;
+  stats.latencies++;
+
+  return latency;
+}
+
+uint8_t reverse_bits(uint8_t value) {
+  uint8_t reversed = 0;
+
+  for (int i = 0; i < 8; i++) {
+    reversed = (reversed << 1) | ((value >> i) & 1);
+  }
+
+  return reversed;
+}
+
+void record_leds() {
+  byte groups[4];
+
+  for (int c = 0; c < 2; c++) {
+    groups[chains[c].first] = reverse_bits(chains[c].outputs >> 8);
+    groups[chains[c].first + 1] = reverse_bits(chains[c].outputs & 0xFF);
+  }
+
+  char state[32];
+
+  for (int i = 0, group = 0; i < numLeds; i++) {
+    if (group < 3 && i >= groupStart[group + 1]) {
+      group++;
+    }
+
+    state[i] = bitRead(groups[group], i - groupStart[group]) ? '1' : '0';
+  }
+  state[numLeds] = '\0';
+
+  stats.led_frames++;
+  const long long latency = record_latency();
+
+  if (frame_log) {
+    fprintf(frame_log, "%llu leds %s %lld\n", board_ns / 1000, state, latency / 1000);
+  }
+}
+
+void board_pin_changed(uint8_t pin, uint8_t level) {
+  if (level != HIGH) {
+    return;
+  }
+
+  for (int c = 0; c < 2; c++) {
+    shift_chain *chain = &chains[c];
+
+    if (pin == chain->clock_pin) {
+      chain->shift = (chain->shift << 1) | pin_levels[chain->data_pin];
+    }
+    else if (pin == chain->latch_pin) {
+      chain->outputs = chain->shift;
+
+      // both latches go high once per frame, log it once the second has
+      if (c == 1) {
+        record_leds();
+      }
+    }
+  }
+}
+
+/*
+ * Logged as the digits, with dots and colon, then the brightness,
+ * e.g. 12:34,2 or DEAD,0
+ */
+void board_display_written(const Adafruit_7segment *display) {
+  char state[16];
+  int length = 0;
+
+  for (int d = 0; d < SEVEN_SEGMENT_POSITIONS; d++) {
+    if (d == SEVEN_SEGMENT_COLON) {
+      if (display->colon) {
+        state[length++] = ':';
+      }
+      continue;
+    }
+
+    state[length++] = display->digits[d] == ' ' ? '_' : display->digits[d];
+
+    if (display->dots[d]) {
+      state[length++] = '.';
+    }
+  }
+  state[length] = '\0';
+
+  stats.display_frames++;
+  const long long latency = record_latency();
+
+  if (frame_log) {
+    fprintf(frame_log, "%llu display %s,%d %lld\n",
+      board_ns / 1000, state, display->brightness, latency / 1000);
+  }
+}
+
+void print_summary() {
+  const double seconds = elapsed_ns() / 1e9;
+
+  printf(
+    "Session: %.2f s, %ld LED frames (%.1f/s), %ld display frames, %ld bytes received (%.0f/s), %ld sent\n",
+    seconds,
+    stats.led_frames,
+    stats.led_frames / seconds,
+    stats.display_frames,
+    stats.rx_bytes,
+    stats.rx_bytes / seconds,
+    stats.tx_bytes
+  );
+
+  printf(
+    "Latency: %lld/%lld/%lld us (min/avg/max), %ld overrun(s), %ld framing error(s)\n",
+    stats.latency_min / 1000,
+    stats.latencies > 0 ? stats.latency_total / stats.latencies / 1000 : 0,
+    stats.latency_max / 1000,
+    stats.overruns,
+    stats.framing_errors
+  );
+
+  unsigned long toggles = 0;
+
+  for (int pin = 0; pin < NUM_DIGITAL_PINS; pin++) {
+    toggles += pin_toggles[pin];
+  }
+
+  printf(
+    "Board: %llu cycles (%.1f%% busy), %lu pin toggles\n",
+    board_cycles,
+    100.0 * board_cycles / (seconds * F_CPU),
+    toggles
+  );
+
+  fflush(stdout);
+}
+
+/*
+ * One power cycle of the board, from the host opening the port until it
+ * closes it again
+ */
+void run_session() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  session_start = (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  rx_line = { rx_bytes, WIRE_BUFFER, 0, 0, 0 };
+  tx_line = { tx_bytes, TX_BUFFER, 0, 0, 0 };
+  Serial.rx_size = rx_buffer_size;
+
+  chains[0] = { dp1, cp1, lp1, 2, 0, 0 };
+  chains[1] = { dp2, cp2, lp2, 0, 0, 0 };
+
+  if (frame_log) {
+    fprintf(frame_log, "# t_us kind state latency_us\n");
+  }
+
+  // anything sent while the bootloader runs is lost
+  board_ns = BOOT_DELAY;
+  bool connected = wait_until(board_ns, false);
+  rx_line.count = 0;
+  rx_line.free_at = 0;
+
+  setup();
+
+  while (connected) {
+    receive(board_ns);
+    transmit(board_ns);
+
+    if (Serial.available() == 0) {
+      // the sketch spins until the next byte arrives
+      if (rx_line.count == 0) {
+        connected = wait_until(elapsed_ns() + IDLE_WAIT, true);
+      }
+
+      const long long next = rx_line.count > 0 ? rx_line.bytes[rx_line.head].due : elapsed_ns();
+
+      if ((long long)board_ns < next) {
+        board_ns = next;
+      }
+
+      receive(board_ns);
+    }
+
+    loop();
+    board_spend(LOOP_CYCLES);
+
+    // keep the sketch from getting ahead of real time, so that its
+    // replies go out when they would have
+    if (connected) {
+      connected = wait_until((long long)board_ns > elapsed_ns() + MAX_AHEAD ? board_ns : 0, false);
+    }
+  }
+
+  // the host may have closed the port with frames still on their way
+  while (!stopping && (rx_line.count > 0 || Serial.available() > 0)) {
+    if (Serial.available() == 0 && (long long)board_ns < rx_line.bytes[rx_line.head].due) {
+      board_ns = rx_line.bytes[rx_line.head].due;
+    }
+
+    receive(board_ns);
+    loop();
+    board_spend(LOOP_CYCLES);
+  }
+
+  print_summary();
+}
+
+/*
+ * Wait for the host to open the port. While nobody has the other end
+ * open, the master side reports a hangup
+ */
+bool wait_for_open() {
+  while (!stopping) {
+    struct pollfd pfd = { master, 0, 0 };
+
+    if (poll(&pfd, 1, 0) == 0) {
+      return true;
+    }
+
+    usleep(OPEN_POLL_INTERVAL * 1000);
+  }
+
+  return false;
+}
+
+int parse_options(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+
+    if (!strncmp(arg, "--log=", 6)) {
+      log_path = arg + 6;
+    } else if (!strncmp(arg, "--link=", 7)) {
+      link_path = arg + 7;
+    } else if (!strncmp(arg, "--capture=", 10)) {
+      capture_path = arg + 10;
+    } else if (!strncmp(arg, "--rx-buffer=", 12)) {
+      rx_buffer_size = atoi(arg + 12);
+
+      if (rx_buffer_size < 1 || rx_buffer_size > SERIAL_RX_BUFFER_MAX) {
+        printf("RX buffer must be 1 to %d bytes!\n", SERIAL_RX_BUFFER_MAX);
+        return -1;
+      }
+    } else {
+      printf("Unknown option %s\n", arg);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (parse_options(argc, argv) != 0) {
+    printf("Usage: %s [--link=PATH] [--log=FILE] [--capture=FILE] [--rx-buffer=BYTES]\n", argv[0]);
+    return 1;
+  }
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    printf("Error %d creating pseudo-terminal!\n", errno);
+    return 1;
+  }
+
+  const char *slave_path = ptsname(master);
+
+  // the master only reports hangups once the slave has been opened and closed
+  close(open(slave_path, O_RDWR | O_NOCTTY));
+
+  if (link_path) {
+    unlink(link_path);
+
+    if (symlink(slave_path, link_path) != 0) {
+      printf("Error %d linking %s to %s!\n", errno, link_path, slave_path);
+      return 1;
+    }
+  }
+
+  if (log_path) {
+    frame_log = fopen(log_path, "a");
+
+    if (!frame_log) {
+      printf("Error %d opening %s!\n", errno, log_path);
+      return 1;
+    }
+  }
+
+  if (capture_path) {
+    capture = fopen(capture_path, "a");
+
+    if (!capture) {
+      printf("Error %d opening %s!\n", errno, capture_path);
+      return 1;
+    }
+  }
+
+  printf("Emulating leds.ino on %s\n", link_path ? link_path : slave_path);
+  fflush(stdout);
+
+  signal(SIGINT, stop_running);
+  signal(SIGTERM, stop_running);
+
+  // the sketch sleeps for microseconds at a time, which the default 50us
+  // of timer slack would swamp
+  prctl(PR_SET_TIMERSLACK, 1);
+
+  while (wait_for_open()) {
+    const pid_t child = fork();
+
+    if (child == 0) {
+      run_session();
+
+      if (frame_log) {
+        fclose(frame_log);
+      }
+      if (capture) {
+        fclose(capture);
+      }
+      exit(0);
+    }
+
+    waitpid(child, NULL, 0);
+
+    tcflush(master, TCIOFLUSH);
+  }
+
+  if (link_path) {
+    unlink(link_path);
+  }
+
+  return 0;
+}
@@ -7,6 +7,55 @@
 #include "Adafruit_LEDBackpack.h"
 #include "Adafruit_GFX.h"
 
+/**
+ * Shift register output drivers, chosen at compile time with SHIFT_DRIVER.
+ *
+ * The LEDs hang off two chains of two 74HC595s (see docs/schematic and
+ * docs/Pins.odt): IC1 -> IC2 holds led[2], led[3] and IC3 -> IC4 holds
+ * led[0], led[1].
+ *
+ * SHIFT_DRIVER_SHIFTOUT (default) and SHIFT_DRIVER_PORT use the wiring as
+ * built:
+ *
+ *   Arduino  ATmega328P  74HC595
+ *   D4       PD4         IC1 pin 14 (DS, data)
+ *   D5       PD5         IC1 pin 12 (ST_CP, latch)
+ *   D6       PD6         IC1 pin 11 (SH_CP, clock)
+ *   D8       PB0         IC3 pin 14 (DS, data)
+ *   D9       PB1         IC3 pin 12 (ST_CP, latch)
+ *   D10      PB2         IC3 pin 11 (SH_CP, clock)
+ *
+ * SHIFT_DRIVER_PORT writes PORTD/PORTB directly instead of going through
+ * digitalWrite(), so it only works on an ATmega328P (Uno, Nano).
+ *
+ * SHIFT_DRIVER_SPI uses the hardware SPI peripheral, which needs both chains
+ * to share the SPI data and clock lines. The latches stay where they are:
+ *
+ *   Arduino  ATmega328P  74HC595
+ *   D11      PB3 (MOSI)  IC1 pin 14 and IC3 pin 14 (DS, data)
+ *   D13      PB5 (SCK)   IC1 pin 11 and IC3 pin 11 (SH_CP, clock)
+ *   D5       PD5         IC1 pin 12 (ST_CP, latch)
+ *   D9       PB1         IC3 pin 12 (ST_CP, latch)
+ *
+ * Shifting one chain also clocks junk into the other chain, but its outputs
+ * only change on a rising edge of its own latch, so this is harmless.
+ * D10 is the SPI SS pin and must stay an output (it is, as cp2).
+ */
+#define SHIFT_DRIVER_SHIFTOUT 0
+#define SHIFT_DRIVER_PORT 1
+#define SHIFT_DRIVER_SPI 2
+
+#ifndef SHIFT_DRIVER
+#define SHIFT_DRIVER SHIFT_DRIVER_SHIFTOUT
+#endif
+
+#if SHIFT_DRIVER == SHIFT_DRIVER_SPI
+#include <SPI.h>
+
+// 74HC595s are good for well over 8MHz at 5V
+#define SPI_CLOCK 8000000
+#endif
+
 #define WORD_ACED 'A'
 #define WORD_BEEF 'B'
 #define WORD_BABE 'C'
@@ -16,6 +65,40 @@
 #define DISPLAY_BRIGHTNESS 2
 #define CMD_QUIET 'Q'
 
+// binary LED frame (v1): header, 30 bits packed LSB first into 4 bytes, checksum
+#define FRAME_LEDS_V1 0xB1
+#define FRAME_LEDS_V1_SIZE 6
+
+// delta commands, applied to the current LEDs. 'e' ends a delta frame
+#define DELTA_TOGGLE 0xC0       // 0xC0 | n: toggle LED n
+#define DELTA_TOGGLE_MASK 0xE0
+#define DELTA_RANGE 0xB2        // start, length | value << 7: set LEDs to value
+#define DELTA_RANGE_SIZE 3
+
+// handshake: the host asks for our version and capabilities, then
+// negotiates the fastest baud rate that works
+#define FIRMWARE_VERSION 1
+
+#define CAP_BINARY 0x01
+#define CAP_DELTA 0x02
+#define CAP_BAUD 0x04
+#define CAP_ACK 0x08
+#define FIRMWARE_CAPS (CAP_BINARY | CAP_DELTA | CAP_BAUD | CAP_ACK)
+
+#define CMD_VERSION 'V'
+#define CMD_BAUD 'S'        // followed by an index into baudRates
+#define CMD_PING 'P'
+#define REPLY_PING 'p'
+#define REPLY_NAK 'N'
+
+// flow control: once enabled, every frame is acknowledged as soon as it
+// has been consumed, so the host knows how much of our receive buffer is free
+#define CMD_FLOW_ON 'F'
+#define REPLY_ACK 'k'
+
+// a new baud rate which isn't pinged within this many ms is abandoned
+#define BAUD_CONFIRM_TIMEOUT 500
+
 Adafruit_7segment display = Adafruit_7segment();
 
 int dp1 = 4;
@@ -26,8 +109,68 @@ int dp2 = 8;
 int lp2 = 9;
 int cp2 = 10;
 
+const unsigned long baudRates[] = {9600, 115200, 250000, 500000, 1000000};
+const int numBaudRates = sizeof(baudRates) / sizeof(baudRates[0]);
+
+bool acksEnabled = false;
+
+int baudIndex = 0;
+bool baudPending = false;
+unsigned long baudSwitchTime = 0;
+
+// led is what the shift registers are showing; frames are assembled in
+// ledBack and only copied across (latched) once they are complete
 byte led[4] = {};
+byte ledBack[4] = {};
+int numLeds = 30;
+
+#if SHIFT_DRIVER == SHIFT_DRIVER_PORT
+/**
+ * shiftOut() replacement which writes the port register directly.
+ * Inlined so that the port and bits are constants, which compile down to
+ * single sbi/cbi instructions
+ */
+static inline __attribute__((always_inline))
+void shiftOutPort(volatile uint8_t *port, uint8_t dataBit, uint8_t clockBit, byte value) {
+  for (byte i = 0; i < 8; i++) {
+    if (value & 1) {
+      *port |= dataBit;
+    }
+    else {
+      *port &= ~dataBit;
+    }
+
+    *port |= clockBit;
+    *port &= ~clockBit;
+
+    value >>= 1;
+  }
+}
+
+void updateShiftRegister() {
+  PORTD &= ~_BV(5);
+  shiftOutPort(&PORTD, _BV(4), _BV(6), led[2]);
+  shiftOutPort(&PORTD, _BV(4), _BV(6), led[3]);
+  PORTD |= _BV(5);
 
+  PORTB &= ~_BV(1);
+  shiftOutPort(&PORTB, _BV(0), _BV(2), led[0]);
+  shiftOutPort(&PORTB, _BV(0), _BV(2), led[1]);
+  PORTB |= _BV(1);
+}
+#elif SHIFT_DRIVER == SHIFT_DRIVER_SPI
+void updateShiftRegister() {
+  PORTD &= ~_BV(5);
+  SPI.transfer(led[2]);
+  SPI.transfer(led[3]);
+  PORTD |= _BV(5);
+
+  PORTB &= ~_BV(1);
+  SPI.transfer(led[0]);
+  SPI.transfer(led[1]);
+  PORTB |= _BV(1);
+}
+#else
 void updateShiftRegister() {
   digitalWrite(lp1, LOW);
   shiftOut(dp1, cp1, LSBFIRST, led[2]);
@@ -39,6 +182,40 @@ void updateShiftRegister() {
   shiftOut(dp2, cp2, LSBFIRST, led[1]);
   digitalWrite(lp2, HIGH);
 }
+#endif
+
+void ackFrame(byte reply) {
+  if (acksEnabled) {
+    Serial.write(reply);
+  }
+}
+
+/**
+ * Shows the frame assembled in the back buffer, if it differs
+ * from what is already shown
+ */
+void latchLeds() {
+  if (memcmp(led, ledBack, sizeof(led)) == 0) {
+    return;
+  }
+
+  memcpy(led, ledBack, sizeof(led));
+
+  updateShiftRegister();
+}
+
+// first LED index of each shift register group
+const int groupStart[4] = {0, 7, 15, 22};
+
+void flipLed(int index) {
+  int group = 3;
+
+  while (index < groupStart[group]) {
+    group--;
+  }
+
+  ledBack[group] ^= 1 << (index - groupStart[group]);
+}
 
 void toggleLed(int index, bool on) {
   int group = 0;
@@ -62,13 +239,95 @@ void toggleLed(int index, bool on) {
   }
 
   if (on) {
-    bitSet(led[group], group_index);
+    bitSet(ledBack[group], group_index);
   }
   else {
-    bitClear(led[group], group_index);
+    bitClear(ledBack[group], group_index);
   }
 }
 
+/**
+ * Decodes a binary frame (everything after the header byte) straight into
+ * the shift register groups. Frames with a bad checksum are dropped
+ */
+void decodeBinaryFrame(byte *frame) {
+  byte checksum = FRAME_LEDS_V1;
+
+  for (int i = 0; i < FRAME_LEDS_V1_SIZE - 1; i++) {
+    checksum ^= frame[i];
+  }
+
+  if (checksum != 0) {
+    ackFrame(REPLY_NAK);
+    return;
+  }
+
+  unsigned long bits = (unsigned long)frame[0] |
+    ((unsigned long)frame[1] << 8) |
+    ((unsigned long)frame[2] << 16) |
+    ((unsigned long)frame[3] << 24);
+
+  // same grouping as toggleLed()
+  ledBack[0] = bits & 0x7F;
+  ledBack[1] = (bits >> 7) & 0xFF;
+  ledBack[2] = (bits >> 15) & 0x7F;
+  ledBack[3] = (bits >> 22) & 0xFF;
+
+  latchLeds();
+  ackFrame(REPLY_ACK);
+}
+
+/**
+ * Sets a run of LEDs, from a delta range command (everything after the
+ * command byte)
+ */
+void decodeDeltaRange(byte *command) {
+  int start = command[0];
+  int length = command[1] & 0x7F;
+  bool on = command[1] & 0x80;
+
+  for (int i = start; i < start + length && i < numLeds; i++) {
+    toggleLed(i, on);
+  }
+}
+
+void sendVersion() {
+  Serial.print("LEDS ");
+  Serial.print(FIRMWARE_VERSION);
+  Serial.print(" ");
+  Serial.print(FIRMWARE_CAPS, HEX);
+  Serial.print(" ");
+  Serial.print(numBaudRates - 1);
+  Serial.print("\n");
+}
+
+void setBaudRate(int index) {
+  Serial.flush(); // let any reply go out at the old rate
+  Serial.end();
+  Serial.begin(baudRates[index]);
+
+  baudIndex = index;
+}
+
+/**
+ * Switches to a new baud rate, which has to be confirmed with a ping
+ * at that rate before BAUD_CONFIRM_TIMEOUT
+ */
+void requestBaudRate(int index) {
+  if (index >= numBaudRates) {
+    Serial.write(REPLY_NAK);
+    return;
+  }
+
+  Serial.write(CMD_BAUD);
+  Serial.write((byte)index);
+
+  setBaudRate(index);
+
+  baudPending = index != 0;
+  baudSwitchTime = millis();
+}
+
 void setup() {
   pinMode(dp1, OUTPUT);
   pinMode(dp2, OUTPUT);
@@ -77,7 +336,12 @@ void setup() {
   pinMode(cp1, OUTPUT);
   pinMode(cp2, OUTPUT);
 
-  Serial.begin(9600);
+#if SHIFT_DRIVER == SHIFT_DRIVER_SPI
+  SPI.begin();
+  SPI.beginTransaction(SPISettings(SPI_CLOCK, LSBFIRST, SPI_MODE0));
+#endif
+
+  Serial.begin(baudRates[0]);
 
   display.begin(0x70);
   display.setBrightness(DISPLAY_BRIGHTNESS); // 0 to 15
@@ -85,6 +349,8 @@ void setup() {
   display.writeDisplay();
 
   updateShiftRegister();
+
+  sendVersion();
 }
 
 int displayIndex = 0;
@@ -92,13 +358,21 @@ bool sendWord = true;
 bool decimalPoint = false;
 
 int ledIndex = 0;
-int numLeds = 30;
 
 int serialInt;
 
 int sendingData = 0;
 
+byte frameBuffer[FRAME_LEDS_V1_SIZE - 1];
+int frameIndex = 0;
+
 void loop() {
+  if (baudPending && millis() - baudSwitchTime > BAUD_CONFIRM_TIMEOUT) {
+    // the host never reached us at the new rate
+    baudPending = false;
+    setBaudRate(0);
+  }
+
   if (Serial.available() > 0) {
     char c = Serial.read();
     
@@ -114,6 +388,37 @@ void loop() {
         ledIndex = 0;
         sendingData = 1;
       }
+      else if ((byte)c == FRAME_LEDS_V1) { // begin binary LED frame
+        frameIndex = 0;
+        sendingData = 3;
+      }
+      else if ((byte)c == DELTA_RANGE) { // begin delta range
+        frameIndex = 0;
+        sendingData = 4;
+      }
+      else if (c == CMD_VERSION) {
+        sendVersion();
+      }
+      else if (c == CMD_BAUD) {
+        sendingData = 5;
+      }
+      else if (c == CMD_PING) {
+        baudPending = false;
+        Serial.write(REPLY_PING);
+      }
+      else if (c == CMD_FLOW_ON) {
+        acksEnabled = true;
+        Serial.write(REPLY_ACK);
+      }
+      else if (c == 'e') { // end of delta frame
+        latchLeds();
+        ackFrame(REPLY_ACK);
+      }
+      else if (((byte)c & DELTA_TOGGLE_MASK) == DELTA_TOGGLE) {
+        if (((byte)c & ~DELTA_TOGGLE_MASK) < numLeds) {
+          flipLed((byte)c & ~DELTA_TOGGLE_MASK);
+        }
+      }
     }
     else {
       switch (sendingData) {
@@ -167,6 +472,7 @@ void loop() {
             sendingData = 0;
 
             display.writeDisplay();
+            ackFrame(REPLY_ACK);
           }
         }
 
@@ -175,14 +481,47 @@ void loop() {
         if (sendWord) {
           sendingData = 0;
           display.writeDisplay();
+          ackFrame(REPLY_ACK);
+        }
+
+        break;
+
+      case 3:
+        frameBuffer[frameIndex++] = c;
+
+        if (frameIndex == FRAME_LEDS_V1_SIZE - 1) {
+          sendingData = 0;
+
+          decodeBinaryFrame(frameBuffer);
+        }
+
+        break;
+
+      case 4:
+        frameBuffer[frameIndex++] = c;
+
+        if (frameIndex == DELTA_RANGE_SIZE - 1) {
+          sendingData = 0;
+
+          decodeDeltaRange(frameBuffer);
         }
 
         break;
 
+      case 5:
+        sendingData = 0;
+
+        requestBaudRate((byte)c);
+
+        break;
+
       case 1:
       default:
         if (c == 'e') { // end
           sendingData = 0;
+
+          latchLeds();
+          ackFrame(REPLY_ACK);
         }
         else if (ledIndex < numLeds) { // ignore extra data
           toggleLed(ledIndex, c == '1' ? true : false);
@@ -191,7 +530,5 @@ void loop() {
         }
       }
     }
-    
-    updateShiftRegister();
   }
 }
@@ -0,0 +1,229 @@
+/**
+ * Micro-benchmarks for the hot paths: rendering a tick of the LED tasks,
+ * the seconds and days patterns, reading /proc/stat, and framing LED
+ * patterns for the serial port. For each one, reports ns/op, allocations
+ * per op and syscalls per op, as JSON so that runs can be diffed.
+ *
+ * Allocations are counted in operator new and malloc, and syscalls in the
+ * libc wrappers the program calls (see the bench target in the Makefile,
+ * which links with --wrap for them). Calls libc makes internally aren't
+ * counted, but nothing here goes through stdio
+ */
+
+#define LEDSEQ_NO_MAIN
+#include "../ledseq.cpp"
+
+#define ITERATIONS_RENDER 2000000
+#define ITERATIONS_PROC 20000
+#define ITERATIONS_WRITE 200000
+
+// long enough that the scroll table is refilled as it goes
+#define LONG_SCROLL_TEXT 5000
+
+long allocations = 0;
+long syscalls = 0;
+
+volatile long sink;
+
+extern "C" {
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *p, size_t size);
+
+  void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *p, size_t size) {
+    allocations++;
+    return __real_realloc(p, size);
+  }
+}
+
+// malloc() from here would go through __wrap_malloc, and be counted twice
+void *operator new(size_t size) {
+  allocations++;
+
+  void *p = __real_malloc(size);
+
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+#define COUNT_SYSCALL(type, name, params, args) \
+  extern "C" type __real_##name params; \
+  extern "C" type __wrap_##name params { \
+    syscalls++; \
+    return __real_##name args; \
+  }
+
+COUNT_SYSCALL(ssize_t, read, (int fd, void *buf, size_t count), (fd, buf, count))
+COUNT_SYSCALL(ssize_t, write, (int fd, const void *buf, size_t count), (fd, buf, count))
+COUNT_SYSCALL(ssize_t, pread, (int fd, void *buf, size_t count, off_t offset), (fd, buf, count, offset))
+COUNT_SYSCALL(int, close, (int fd), (fd))
+COUNT_SYSCALL(int, poll, (struct pollfd *fds, nfds_t nfds, int timeout), (fds, nfds, timeout))
+COUNT_SYSCALL(int, usleep, (useconds_t us), (us))
+
+/*
+ * Counters at the start of a run, to report the difference from
+ */
+struct bench_start {
+  long long ns;
+  long allocations;
+  long syscalls;
+};
+
+bench_start begin_run() {
+  return { monotonic_ns(), allocations, syscalls };
+}
+
+bool first_result = true;
+
+void report(const char *name, const bench_start *start, int iterations) {
+  const long long elapsed = monotonic_ns() - start->ns;
+
+  printf("%s\n    { \"name\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.2f, \"allocs_per_op\": %.4f, \"syscalls_per_op\": %.4f }",
+    first_result ? "" : ",",
+    name,
+    iterations,
+    (double)elapsed / iterations,
+    (double)(allocations - start->allocations) / iterations,
+    (double)(syscalls - start->syscalls) / iterations);
+
+  first_result = false;
+}
+
+/*
+ * An LED task drawing across the whole bar, as create_tasks() sets them up
+ */
+task *create_bench_task(const char *name, char *arg, compositor *output) {
+  char *args[] = { arg, NULL };
+  const task_config config = { args, NUM_LEDS, false };
+
+  task *created = find_task_type(name)->create(&config);
+
+  created->name = name;
+  created->output = output;
+  created->first = 0;
+  created->width = NUM_LEDS;
+  created->blend = BLEND_OVER;
+
+  return created;
+}
+
+void bench_task(const char *name, task *ticked, compositor *output) {
+  const bench_start start = begin_run();
+
+  for (int i = 0; i < ITERATIONS_RENDER; i++) {
+    ticked->tick(0, i);
+    output->dirty = false;
+  }
+
+  report(name, &start, ITERATIONS_RENDER);
+
+  sink = ticked->layer.bits;
+}
+
+void bench_write_pattern(const char *name, serial_writer *writer, int protocol) {
+  writer->protocol = protocol;
+  writer->delta = { 0, false, 0 };
+
+  const bench_start start = begin_run();
+
+  for (int i = 0; i < ITERATIONS_WRITE; i++) {
+    write_pattern(writer, pong_frames.frames[i % pong_frames.period]);
+  }
+
+  report(name, &start, ITERATIONS_WRITE);
+}
+
+int main() {
+  compositor output = {};
+
+  char short_text[] = "1110101011";
+  char long_text[LONG_SCROLL_TEXT + 1];
+
+  for (int i = 0; i < LONG_SCROLL_TEXT; i++) {
+    long_text[i] = i % 7 < 3 ? '1' : '0';
+  }
+
+  long_text[LONG_SCROLL_TEXT] = '\0';
+
+  task *scroll = create_bench_task("scrolltext", short_text, &output);
+  task *long_scroll = create_bench_task("scrolltext", long_text, &output);
+  task *pong = create_bench_task("pong", NULL, &output);
+
+  if (init_io() != 0) {
+    return 1;
+  }
+
+  const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  serial_writer *writer = create_writer("/dev/null", fd);
+
+  if (fd < 0 || writer == NULL) {
+    printf("Error opening /dev/null!\n");
+    return 1;
+  }
+
+  printf("{\n  \"benchmarks\": [");
+
+  bench_task("scrolltext tick", scroll, &output);
+  bench_task("scrolltext tick (long)", long_scroll, &output);
+  bench_task("pong tick", pong, &output);
+
+  bench_start start;
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_RENDER; i++) sink = seconds_pattern(i).bits;
+  report("seconds_pattern", &start, ITERATIONS_RENDER);
+
+  char pattern[11];
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_RENDER; i++) seconds_to_days(i * 37.0, pattern);
+  report("seconds_to_days", &start, ITERATIONS_RENDER);
+
+  sink = pattern[0];
+
+  cpu_time times;
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_PROC; i++) get_cpu_time(&times);
+  report("get_cpu_time", &start, ITERATIONS_PROC);
+
+  sink = times.time_total;
+
+  bench_write_pattern("write_pattern ascii", writer, PROTOCOL_ASCII);
+  bench_write_pattern("write_pattern binary", writer, PROTOCOL_BINARY);
+  bench_write_pattern("write_pattern delta", writer, PROTOCOL_DELTA);
+
+  // handing a frame to the I/O thread, which isn't running
+  uint64_t count;
+
+  start = begin_run();
+  for (int i = 0; i < ITERATIONS_WRITE; i++) set_pattern(fd, pong_frames.frames[i % pong_frames.period]);
+  report("set_pattern", &start, ITERATIONS_WRITE);
+
+  read(writer->wake_fd, &count, sizeof(count));
+
+  printf("\n  ]\n}\n");
+
+  return 0;
+}
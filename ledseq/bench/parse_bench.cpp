@@ -0,0 +1,141 @@
+/**
+ * Micro-benchmark for the /proc parsers: the old fopen/fscanf path against
+ * sscanf and the field scanners, on captured copies of /proc/stat and
+ * /proc/meminfo (bench/data by default, or the directory given)
+ */
+
+#define LEDSEQ_NO_MAIN
+#include "../ledseq.cpp"
+
+#define ITERATIONS_FILE 20000
+#define ITERATIONS_MEMORY 200000
+
+volatile long unsigned int sink;
+
+/*
+ * Read a whole file into a null-terminated buffer
+ */
+char *read_file(const char *path) {
+  FILE *fp = fopen(path, "r");
+
+  if (!fp) {
+    printf("Error reading %s!\n", path);
+    exit(1);
+  }
+
+  char *buf = (char *)malloc(PROC_STAT_BUFFER);
+  const size_t bytes_read = fread(buf, 1, PROC_STAT_BUFFER - 1, fp);
+  buf[bytes_read] = '\0';
+
+  fclose(fp);
+
+  return buf;
+}
+
+/* what get_cpu_time() and get_mem_usage() used to do */
+void stat_fscanf(const char *path) {
+  FILE *fstat = fopen(path, "r");
+  long unsigned int times[10];
+
+  fscanf(fstat, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+    &times[0], &times[1], &times[2], &times[3],
+    &times[4], &times[5], &times[6], &times[7],
+    &times[8], &times[9]);
+
+  fclose(fstat);
+
+  sink = times[3];
+}
+
+void meminfo_fscanf(const char *path) {
+  FILE *fstat = fopen(path, "r");
+  long unsigned int usage[5];
+
+  fscanf(fstat, "%*s %lu %*s %*s %lu %*s %*s %lu %*s %*s %lu %*s %*s %lu %*s",
+    &usage[0], &usage[1], &usage[2], &usage[3], &usage[4]);
+
+  fclose(fstat);
+
+  sink = usage[2];
+}
+
+void stat_sscanf(const char *buf) {
+  long unsigned int times[10];
+
+  sscanf(buf, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+    &times[0], &times[1], &times[2], &times[3],
+    &times[4], &times[5], &times[6], &times[7],
+    &times[8], &times[9]);
+
+  sink = times[3];
+}
+
+void meminfo_sscanf(const char *buf) {
+  long unsigned int usage[5];
+
+  sscanf(buf, "%*s %lu %*s %*s %lu %*s %*s %lu %*s %*s %lu %*s %*s %lu %*s",
+    &usage[0], &usage[1], &usage[2], &usage[3], &usage[4]);
+
+  sink = usage[2];
+}
+
+void stat_scanner(const char *buf) {
+  long unsigned int times[10];
+
+  scan_stat_fields(buf, times, 10);
+
+  sink = times[3];
+}
+
+void meminfo_scanner(const char *buf) {
+  meminfo result;
+
+  parse_meminfo(buf, &result);
+
+  sink = result.mem_available;
+}
+
+void report(const char *name, long long start, int iterations) {
+  printf("%-24s %10.1f ns/op\n", name, (double)(monotonic_ns() - start) / iterations);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dir = argc > 1 ? argv[1] : "bench/data";
+
+  char stat_path[256];
+  char meminfo_path[256];
+
+  snprintf(stat_path, sizeof(stat_path), "%s/stat", dir);
+  snprintf(meminfo_path, sizeof(meminfo_path), "%s/meminfo", dir);
+
+  const char *stat_buf = read_file(stat_path);
+  const char *meminfo_buf = read_file(meminfo_path);
+
+  long long start;
+
+  start = monotonic_ns();
+  for (int i = 0; i < ITERATIONS_FILE; i++) stat_fscanf(stat_path);
+  report("stat fopen+fscanf", start, ITERATIONS_FILE);
+
+  start = monotonic_ns();
+  for (int i = 0; i < ITERATIONS_MEMORY; i++) stat_sscanf(stat_buf);
+  report("stat sscanf", start, ITERATIONS_MEMORY);
+
+  start = monotonic_ns();
+  for (int i = 0; i < ITERATIONS_MEMORY; i++) stat_scanner(stat_buf);
+  report("stat scanner", start, ITERATIONS_MEMORY);
+
+  start = monotonic_ns();
+  for (int i = 0; i < ITERATIONS_FILE; i++) meminfo_fscanf(meminfo_path);
+  report("meminfo fopen+fscanf", start, ITERATIONS_FILE);
+
+  start = monotonic_ns();
+  for (int i = 0; i < ITERATIONS_MEMORY; i++) meminfo_sscanf(meminfo_buf);
+  report("meminfo sscanf", start, ITERATIONS_MEMORY);
+
+  start = monotonic_ns();
+  for (int i = 0; i < ITERATIONS_MEMORY; i++) meminfo_scanner(meminfo_buf);
+  report("meminfo scanner", start, ITERATIONS_MEMORY);
+
+  return 0;
+}
@@ -10,23 +10,38 @@
 #include <time.h>
 #include <chrono>
 #include <errno.h>
+#include <stdarg.h>
 #include <climits>
+#include <stdint.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <queue>
+#include <vector>
+#include <type_traits>
 
 using namespace std;
 
 #define NUM_LEDS 30
 
 // all times are in micro seconds
+#define DEFAULT_INTERVAL 1000000
 #define SCROLL_INTERVAL 50000
 #define PONG_INTERVAL 20000
 #define MEM_INTERVAL 1000000
 
-// words -> int
-#define WORD_ACED 0
-#define WORD_BEEF 1
-#define WORD_BABE 2
-#define WORD_DEAD 3
-#define WORD_DEAF 4
+// the ball goes from the first LED to the last and back again
+#define PONG_PERIOD ((NUM_LEDS - 1) * 2)
+
+// frames of scroll text worked out at a time, 4KB worth
+#define SCROLL_TABLE_SIZE 1024
 
 // time modes
 #define TIME_MODE_UPTIME 0
@@ -35,8 +50,60 @@ using namespace std;
 // unix time stamp (2016-01-23 11:36:52 GMT)
 #define INSTALLATION_TIME 1453549012
 
-// sample /proc/stat every 200ms
+// serial protocols understood by the firmware
+#define PROTOCOL_AUTO -1
+#define PROTOCOL_ASCII 0
+#define PROTOCOL_BINARY 1
+#define PROTOCOL_DELTA 2
+
+// binary LED frame (v1): header, 30 bits packed LSB first into 4 bytes, checksum
+#define FRAME_LEDS_V1 0xB1
+#define FRAME_LEDS_V1_SIZE 6
+
+// delta commands, applied to the last frame. 'e' ends a delta frame
+#define DELTA_TOGGLE 0xC0       // 0xC0 | n: toggle LED n
+#define DELTA_RANGE 0xB2        // start, length | value << 7: set LEDs to value
+#define DELTA_RANGE_SIZE 3
+#define DELTA_END 'e'
+
+// send a full frame every so often, in case a delta went missing
+#define KEYFRAME_INTERVAL 100
+
+// startup handshake, see handshake()
+#define CMD_VERSION 'V'
+#define CMD_BAUD 'S'
+#define CMD_PING 'P'
+#define REPLY_PING 'p'
+#define CMD_FLOW_ON 'F'
+
+#define CAP_BINARY 0x01
+#define CAP_DELTA 0x02
+#define CAP_BAUD 0x04
+#define CAP_ACK 0x08
+
+#define HANDSHAKE_BOOT_TIMEOUT 2500000  // the board resets when the port is opened
+#define HANDSHAKE_REPLY_TIMEOUT 250000
+#define HANDSHAKE_VERSION_RETRIES 3
+#define BAUD_SWITCH_SETTLE 10000
+#define BAUD_CONFIRM_TIMEOUT 500000     // firmware reverts to 9600 if not pinged by then
+#define BAUD_PING_COUNT 8
+
+// flow control: the firmware acknowledges every frame once it has been
+// consumed, and we never have more than its receive buffer in flight
+#define REPLY_ACK 'k'
+#define REPLY_NAK 'N'
+#define FLOW_RX_BUFFER 64
+#define FLOW_ACK_TIMEOUT 200000
+
+// default sampling intervals, which --sample-<metric>=<ms> overrides
+// (memory uses MEM_INTERVAL)
 #define CPU_USAGE_SAMPLE_TIME 200000
+#define TEMPS_SAMPLE_TIME 1000000
+#define UPTIME_SAMPLE_TIME 1000000
+
+// the per-core heatmap redraws faster than it samples, to dither intensity
+#define HEATMAP_INTERVAL 10000
+#define MAX_CPUS 1024
 
 /** Sensors stuff */
 #define SENSORS_ERR_WILDCARDS	1 /* Wildcard found in chip name */
@@ -252,917 +319,4193 @@ void set_blocking(int fd, int should_block) {
 }
 
 /*
- * Simple method to add one string to (part of) another
+ * glibc's <termios.h> only knows the fixed Bxxx speeds, and the kernel's
+ * <asm/termbits.h> clashes with it, so declare the kernel's termios2 here
+ * for TCGETS2/TCSETS2. This is what lets us ask for e.g. 250000 baud
  */
-void stradd(char *dst, char *src, int offset, int length) {
-  for (int i = offset, j = 0; j < length; i++, j++) {
-    dst[i] = src[j];
-  }
-}
+struct termios2 {
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
 
-void set_display(int fd, char *pattern) {
-  char data[11];
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
 
-  data[0] = 'c'; // send begin command to arduino
+int set_baud_rate(int fd, int baud) {
+  struct termios2 tty;
 
-  stradd(data, pattern, 1, 10);
+  if (ioctl(fd, TCGETS2, &tty) != 0) {
+    printf("error %d from TCGETS2\n", errno);
+    return -1;
+  }
 
-  write(fd, data, 11);
+  tty.c_cflag &= ~CBAUD;
+  tty.c_cflag |= BOTHER;
+  tty.c_ispeed = baud;
+  tty.c_ospeed = baud;
 
-  usleep((5 + 25) * 100);
+  if (ioctl(fd, TCSETS2, &tty) != 0) {
+    printf("error %d from TCSETS2\n", errno);
+    return -1;
+  }
 
-  return;
+  return 0;
 }
 
-/*
- * This is a method used by other functions to tell the arduino
- * which LEDs to light up
- */
-void set_pattern(int fd, char *pattern) {
-  char data[NUM_LEDS + 2];
-
-  data[0] = 'b';              // send begin command to arduino
-  data[NUM_LEDS + 1] = 'e';   // send end command to arduino
-
-  // as far as the arduino is concerned, each character comes on its own.
-  // There is no need for the string to be null-terminated like a string in C
-  // data[NUM_LEDS + 2] = '\0';  // terminate with null character
+long long monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-  stradd(data, pattern, 1, NUM_LEDS);
-  
-  write(fd, data, NUM_LEDS + 2);
-
-  usleep((NUM_LEDS + 2 + 25) * 100);
-
-  return;
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
 }
 
-/* Backend functions */
-
-/**
- * Get each CPU's temperature, and return it as one int
- * e.g. if CPU0 is 35C, CPU1 30C, then this function would return 3035
- */
-int get_temps(char *temps) {
-  int value;
-
-  int TEMP_IDX_MAX = 2;
-  FILE *fp;
-  const char* n[] = {
-    "/sys/class/hwmon/hwmon1/temp2_input",
-    "/sys/class/hwmon/hwmon1/temp3_input"
-  };
-
-  for (int i = 0, o = 0; i < TEMP_IDX_MAX; i++) {
-    if (fp = fopen(n[i], "r")) {
-      char buf[256];
-      size_t bytes_read;
-
-      bytes_read = fread(buf, 1, sizeof(buf), fp);
-
-      fclose(fp);
-
-      if (bytes_read == 0 || bytes_read == sizeof(buf)) {
-        printf("Error reading sensor values!\n");
-        return -1;
-      }
-
-      buf[bytes_read] = '\0';
+long long monotonic_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
 
-      value = (int)strtol(buf, NULL, 10);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-      value /= get_type_scaling(SENSORS_SUBFEATURE_TEMP_INPUT);
+// cleared by SIGINT or SIGTERM, so that nothing keeps waiting on a device
+volatile sig_atomic_t running = 1;
 
-      // this shouldn't be necessary, unless
-      // (a) someone put liquid nitrogen on the motherboard, or
-      // (b) the sensor is calibrated incorrectly
-      value = abs(value);
+// the longest serial_read() goes without checking running, us. The signal
+// can land on any thread, so it can't be relied on to interrupt poll()
+#define SERIAL_READ_STOP_CHECK 100000
 
-      if (value > 99) {
-        // hopefully this would never happen!!!
-        value = 99;
-      }
+/*
+ * Read up to length bytes, giving up after timeout microseconds, or once
+ * we are stopping. Returns the number of bytes read
+ */
+int serial_read(int fd, uint8_t *buf, int length, int timeout) {
+  const long long deadline = monotonic_us() + timeout;
+  int total = 0;
 
-      int unit  = value % 10;
-      int ten   = floor(value / 10);
+  while (total < length && running) {
+    const long long remaining = min(deadline - monotonic_us(), (long long)SERIAL_READ_STOP_CHECK);
 
-      char tmp_string[5];
-      sprintf(tmp_string, "0%d0%d", ten, unit);
+    if (remaining <= 0) {
+      break;
+    }
 
-      stradd(temps, tmp_string, o, 4);
+    struct pollfd pfd = { fd, POLLIN, 0 };
 
-      o += 4;
+    if (poll(&pfd, 1, (int)((remaining + 999) / 1000)) <= 0) {
+      continue;
+    }
 
-      if (i == 0) {
-        // add parameter to print colon
-        char colon[3] = "10";
+    const int bytes_read = read(fd, buf + total, length - total);
 
-        stradd(temps, colon, o, 2);
-        o += 2;
-      }
-    }
-    else {
-      return -SENSORS_ERR_KERNEL;
+    if (bytes_read > 0) {
+      total += bytes_read;
     }
   }
 
-  return 0;
+  return total;
 }
 
+/** Event loop */
+typedef void (*EventCallback)(void *data);
+typedef void (*TimerCallback)(void *data, long long now);
+
 /*
- * Get current memory usage values from /proc/meminfo
+ * A file descriptor which the event loop waits on. The callback runs
+ * whenever it is readable. If the fd hangs up or fails, the watch is
+ * dropped and the callback runs once more, to find that out from read()
  */
-struct meminfo {
-  long unsigned int mem_total;
-  long unsigned int mem_free;
-  long unsigned int mem_available;
-  long unsigned int mem_buffers;
-  long unsigned int mem_cached;
+struct fd_watch {
+  int fd;
+  EventCallback callback;
+  void *data;
 };
 
+// lateness histogram: 1us buckets below 64us, then 32 buckets per power of
+// two, which is within ~3% and covers anything up to days
+#define LATENESS_LINEAR_BUCKETS 64
+#define LATENESS_SUB_BUCKETS 32
+#define LATENESS_BUCKETS (LATENESS_LINEAR_BUCKETS + 58 * LATENESS_SUB_BUCKETS)
+
 /*
- * Get the current memory usage of the machine
+ * How late a timer's callbacks ran, relative to their deadlines
  */
-int get_mem_usage(double *fraction) {
-  meminfo mem_usage;
-
-  FILE *fstat = fopen("/proc/meminfo", "r");
-  
-  if (!fstat) {
-    printf("Error reading from /proc/meminfo!\n");
-    return -1;
-  }
-
-  long unsigned int usage[5];
-  
-  // bzero(times, sizeof(times));
-  if (fscanf(fstat, "%*s %lu %*s %*s %lu %*s %*s %lu %*s %*s %lu %*s %*s %lu %*s",
-        &usage[0], &usage[1], &usage[2], &usage[3], &usage[4]
-      ) == EOF) {
+struct timer_stats {
+  long long runs;
+  long long skipped;        // ticks dropped because we fell a whole interval behind
+  long long lateness_min;
+  long long lateness_max;
+  long long lateness_total;
+  int histogram[LATENESS_BUCKETS];
+};
 
-    fclose(fstat);
-    return -1;
+int lateness_bucket(long long lateness) {
+  if (lateness < LATENESS_LINEAR_BUCKETS) {
+    return lateness < 0 ? 0 : (int)lateness;
   }
 
-  fclose(fstat);
-
-  mem_usage.mem_total     = usage[0];
-  mem_usage.mem_free      = usage[1];
-  mem_usage.mem_available = usage[2];
-  mem_usage.mem_buffers   = usage[3];
-  mem_usage.mem_cached    = usage[4];
-
-  *fraction = ((double)(mem_usage.mem_total - (
-    mem_usage.mem_free + mem_usage.mem_buffers + mem_usage.mem_cached
-  )) / (double)(mem_usage.mem_total));
+  const int msb = 63 - __builtin_clzll(lateness);
 
-  return 0;
+  return LATENESS_LINEAR_BUCKETS +
+    (msb - 6) * LATENESS_SUB_BUCKETS +
+    (int)((lateness >> (msb - 5)) & (LATENESS_SUB_BUCKETS - 1));
 }
 
 /*
- * Get current CPU time values from /proc/stat
+ * The largest lateness which falls into a bucket
  */
-struct cpu_time {
-  long unsigned int time_total;
-  long unsigned int time_user;
-  long unsigned int time_nice;
-  long unsigned int time_system;
-  long unsigned int time_idle;
-  long unsigned int time_iowait;
-  long unsigned int time_irq;
-  long unsigned int time_softirq;
-};
-
-int get_cpu_time(cpu_time* result) {
-  FILE *fstat = fopen("/proc/stat", "r");
-  
-  if (!fstat) {
-    printf("Error reading from /proc/stat!\n");
-    return -1;
+long long lateness_bucket_max(int bucket) {
+  if (bucket < LATENESS_LINEAR_BUCKETS) {
+    return bucket;
   }
 
-  long unsigned int times[10];
-  
-  // bzero(times, sizeof(times));
-  if (fscanf(fstat, "%*s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
-        &times[0], &times[1], &times[2], &times[3],
-        &times[4], &times[5], &times[6], &times[7],
-        &times[8], &times[9]
-      ) == EOF) {
-
-    fclose(fstat);
-    return -1;
-  }
+  const int msb = (bucket - LATENESS_LINEAR_BUCKETS) / LATENESS_SUB_BUCKETS + 6;
+  const int sub = (bucket - LATENESS_LINEAR_BUCKETS) % LATENESS_SUB_BUCKETS;
 
-  fclose(fstat);
+  return ((long long)(LATENESS_SUB_BUCKETS + sub + 1) << (msb - 5)) - 1;
+}
 
-  result->time_user = times[0];
-  result->time_nice = times[1];
-  result->time_system = times[2];
-  result->time_idle = times[3];
-  result->time_iowait = times[4];
-  result->time_irq = times[5];
-  result->time_softirq = times[6];
-  
-  result->time_total =
-    result->time_user +
-    result->time_nice +
-    result->time_system +
-    result->time_iowait +
-    result->time_idle
-  ;
+void timer_stats_add(timer_stats *stats, long long lateness) {
+  if (stats->runs == 0 || lateness < stats->lateness_min) {
+    stats->lateness_min = lateness;
+  }
+  if (lateness > stats->lateness_max) {
+    stats->lateness_max = lateness;
+  }
 
-  return 0;
+  stats->lateness_total += lateness;
+  stats->histogram[lateness_bucket(lateness)]++;
+  stats->runs++;
 }
 
-/*
- * Get the current CPU usage of the machine
- */
-void get_cpu_usage(double *fraction) {
-  cpu_time last, current;
-
-  if (get_cpu_time(&last) == -1) {
-    printf("error\n");
-  }
+long long timer_stats_percentile(const timer_stats *stats, double percentile) {
+  const long long target = (long long)ceil(stats->runs * percentile / 100);
+  long long seen = 0;
 
-  usleep(CPU_USAGE_SAMPLE_TIME);
+  for (int i = 0; i < LATENESS_BUCKETS; i++) {
+    seen += stats->histogram[i];
 
-  if (get_cpu_time(&current) == -1) {
-    printf("error\n");
+    if (seen >= target && seen > 0) {
+      return min(lateness_bucket_max(i), stats->lateness_max);
+    }
   }
 
-  const long unsigned int diff_idle   = current.time_idle  - last.time_idle;
-  const long unsigned int diff_total  = current.time_total - last.time_total;
-
-  *fraction = ((double)(diff_total - diff_idle) / (double)diff_total);
+  return stats->lateness_max;
 }
 
 /*
- * Get the number of seconds since INSTALLATION_TIME
+ * Something to run at an absolute CLOCK_MONOTONIC time (in us), and then
+ * every interval after that. An interval of 0 means run once.
+ *
+ * Deadlines always stay on the grid of the first one, so that repeating
+ * timers never drift, however late their callbacks run
  */
-void get_time_seconds(double *seconds) {
-  double current_time = (double)time(NULL);
+struct loop_timer {
+  long long due;
+  long long interval;
+  long long ticks;          // number of intervals since the first deadline
+  TimerCallback callback;
+  void *data;
+  timer_stats *stats;       // optional
+};
 
-  *seconds = current_time - INSTALLATION_TIME;
-}
+struct timer_later {
+  bool operator()(const loop_timer *a, const loop_timer *b) const {
+    return a->due > b->due;
+  }
+};
 
 /*
- * Get the number of seconds the machine has been on without
- * a reboot
+ * Sleeps in epoll_wait until a watched fd is readable or the earliest timer
+ * is due. Timers are kept in a min-heap of deadlines, and one timerfd is
+ * armed for whichever is first, so any number of timers costs nothing
+ * while waiting
  */
-int get_uptime_seconds(double *seconds) {
-  const char *error_text = "** Error reading from uptime file!";
+struct event_loop {
+  int epoll_fd;
+  bool stopped;
 
-  FILE *fp = fopen("/proc/uptime", "r");
-  
-  if (!fp) {
-    printf("%s\n", error_text);
-    return -1;
-  }
+  // called after each round of timers and events, before sleeping
+  EventCallback idle;
+  void *idle_data;
 
-  char buf[256];
-  size_t bytes_read;
+  fd_watch timer_watch;
+  std::priority_queue<loop_timer *, std::vector<loop_timer *>, timer_later> timers;
+};
 
-  bytes_read = fread(buf, 1, sizeof(buf), fp);
+int event_loop_watch(event_loop *loop, fd_watch *watch) {
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
 
-  fclose(fp);
+  event.events = EPOLLIN;
+  event.data.ptr = watch;
 
-  if (bytes_read == 0 || bytes_read == sizeof(buf)) {
-    printf("%s\n", error_text);
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, watch->fd, &event) != 0) {
+    printf("error %d watching fd %d\n", errno, watch->fd);
     return -1;
   }
 
-  buf[bytes_read] = '\0';
-
-  char *uptime = strtok(buf, " ");
+  return 0;
+}
 
-  *seconds = atof(uptime);
+void event_loop_unwatch(event_loop *loop, fd_watch *watch) {
+  // it may already have been dropped on a hangup
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+}
 
-  return 0;
+void event_loop_read_timer(void *data) {
+  uint64_t expirations;
+  read(((event_loop *)data)->timer_watch.fd, &expirations, sizeof(expirations));
 }
 
-/*
- * Calculate which LEDs should be on or off, so as to
- * represent the uptime in seconds, as a binary number,
- * where an LED being on represents "1", and off "0".
- *
- * E.g. an uptime of 186 seconds would be represented by the binary
- * number 0b10111010.
- */
-void set_seconds_pattern(int fd, long *seconds) {
-  char digits[NUM_LEDS + 1];
+int event_loop_init(event_loop *loop) {
+  loop->stopped = false;
+  loop->idle = NULL;
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 
-  long num = *seconds;
+  if (loop->epoll_fd < 0) {
+    printf("error %d from epoll_create1\n", errno);
+    return -1;
+  }
 
-  int digit = 0;
-  while (digit < NUM_LEDS) {
-    if (num > 0) {
-      digits[NUM_LEDS - 1 - digit] = (num % 2) + '0';
-      
-      num = floor(num / 2);
-    }
-    else {
-      digits[NUM_LEDS - 1 - digit] = '0';
-    }
+  loop->timer_watch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  loop->timer_watch.callback = event_loop_read_timer;
+  loop->timer_watch.data = loop;
 
-    digit++;
+  if (loop->timer_watch.fd < 0) {
+    printf("error %d from timerfd_create\n", errno);
+    return -1;
   }
 
-  digits[NUM_LEDS] = '\0';
+  return event_loop_watch(loop, &loop->timer_watch);
+}
 
-  set_pattern(fd, digits);
+void event_loop_add_timer(event_loop *loop, loop_timer *timer) {
+  loop->timers.push(timer);
 }
 
-/**
- * sets the correct number on the LED display, given a number of seconds
+/*
+ * Arm the timerfd for the earliest timer, or disarm it if there are none
  */
-void seconds_to_days(double seconds, char *pattern) {
-  // max 9999 days = 27 years
-  double days_raw = fmin(seconds / 86400, 9999);
-  
-  int days = floor(days_raw);
+void event_loop_arm(event_loop *loop) {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
 
-  // decimal point precision
-  int precision = 0;
+  if (!loop->timers.empty()) {
+    // a deadline of 0 would disarm the timer rather than fire it
+    const long long due = max(loop->timers.top()->due, 1LL);
 
-  if (days < 10) {
-    precision = 3;
-  }
-  else if (days < 100) {
-    precision = 2;
+    spec.it_value.tv_sec = due / 1000000;
+    spec.it_value.tv_nsec = (due % 1000000) * 1000;
   }
-  else if (days < 1000) {
-    precision = 1;
-  }
-
-  int last_digits = round((days_raw - days) * pow(10, precision));
-
-  days = days * pow(10, precision) + last_digits;
-
-  int u1 = days % 10;
-  int u2 = (int)floor(days / 10) % 10;
-  int u3 = (int)floor(days / 100) % 10;
-  int u4 = (int)floor(days / 1000) % 10;
-
-  int dp1 = precision == 1;
-  int dp2 = precision == 2;
-  int dp3 = precision == 3;
 
-  sprintf(pattern, "%d%d%d%d00%d%d0%d", dp3, u4, dp2, u3, dp1, u2, u1);
+  timerfd_settime(loop->timer_watch.fd, TFD_TIMER_ABSTIME, &spec, NULL);
 }
 
-/** Pattern generating functions */
-/**
- * output the CPU temperature to the LED display
- */
-int do_temps(int args[1], int loop, char *seq) {
-  const int fd = args[0];
+void event_loop_run_timers(event_loop *loop) {
+  const long long now = monotonic_us();
 
-  char temps[11] = "0000000000";
+  while (!loop->stopped && !loop->timers.empty() && loop->timers.top()->due <= now) {
+    loop_timer *timer = loop->timers.top();
+    loop->timers.pop();
 
-  get_temps(temps);
-
-  set_display(fd, temps);
+    if (timer->stats != NULL) {
+      timer_stats_add(timer->stats, now - timer->due);
+    }
 
-  return 0;
-}
+    timer->callback(timer->data, now);
 
-/**
- * output a word to the LED display
- */
-int do_word(int args[2], int loop, char *seq) {
-  const int fd = args[0];
-  const int word = args[1];
+    if (timer->interval > 0) {
+      // if we fell a whole interval or more behind, skip the ticks we missed
+      // rather than running them back to back
+      const long long missed = (now - timer->due) / timer->interval;
 
-  char display_string[11];
+      timer->due += (missed + 1) * timer->interval;
+      timer->ticks += missed + 1;
 
-  switch (word) {
-  case WORD_ACED:
-    sprintf(display_string, "A000000000");
-    break;
-  case WORD_BEEF:
-    sprintf(display_string, "B000000000");
-    break;
-  case WORD_BABE:
-    sprintf(display_string, "C000000000");
-    break;
-  case WORD_DEAD:
-    sprintf(display_string, "D000000000");
-    break;
-  case WORD_DEAF:
-    sprintf(display_string, "F000000000");
-    break;
-  default:
-    printf("%d is not a recognised word. Sorry!\n", word);
+      if (timer->stats != NULL) {
+        timer->stats->skipped += missed;
+      }
 
-    return 1;
+      loop->timers.push(timer);
+    }
   }
+}
 
-  set_display(fd, display_string);
-
-  return 0;
+void stop_event_loop(void *data) {
+  ((event_loop *)data)->stopped = true;
 }
 
-/*
- * A string, e.g. 1110101011, is given as a parameter to the
- * program, and this function makes the LEDs "scroll" that pattern
- * as if it was text on a notice board.
- */
-int do_scrolltext(int args[1], int loop, char *seq) {
-  const int fd = args[0];
+void event_loop_run_idle(event_loop *loop) {
+  if (loop->idle != NULL) {
+    loop->idle(loop->idle_data);
+  }
+}
 
-  int offset;
+void event_loop_run(event_loop *loop) {
+  struct epoll_event events[8];
 
-  char str[NUM_LEDS + 1];
+  event_loop_run_timers(loop);
+  event_loop_run_idle(loop);
 
-  const int size = strlen(seq);
+  while (!loop->stopped) {
+    event_loop_arm(loop);
 
-  if (size <= NUM_LEDS) {
-    // we can fit the entire string on the board
-    offset = loop % NUM_LEDS;
-    
-    // check if we have to split seq into two parts
-    if (offset + size <= NUM_LEDS) {
-      // the string + offset still fits on the board
-      char str1[offset];
-      memset(str1, '0', offset);
+    const int num_events = epoll_wait(loop->epoll_fd, events, 8, -1);
 
-      stradd(str, str1, 0, offset);
+    for (int i = 0; i < num_events && !loop->stopped; i++) {
+      fd_watch *watch = (fd_watch *)events[i].data.ptr;
 
-      stradd(str, seq, offset, size);
-      
-      char str3[NUM_LEDS - size - offset];
-      memset(str3, '0', NUM_LEDS - size - offset);
+      // these stay set, so the loop would never sleep again
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        event_loop_unwatch(loop, watch);
+      }
 
-      stradd(str, str3, offset + size, NUM_LEDS - size - offset);
+      watch->callback(watch->data);
     }
-    else {
-      // have to split the string into two
-      int num_chars_cut = offset + size - NUM_LEDS;
-
-      char str1[num_chars_cut];
-      memcpy(str1, &seq[size - num_chars_cut], num_chars_cut);
-   
-      stradd(str, str1, 0, num_chars_cut);
 
-      char str2[NUM_LEDS - size];
-      memset(str2, '0', NUM_LEDS - size);
+    event_loop_run_timers(loop);
+    event_loop_run_idle(loop);
+  }
+}
 
-      stradd(str, str2, num_chars_cut, NUM_LEDS - size);
+/*
+ * Frames sent to the arduino which it hasn't acknowledged yet
+ */
+struct flow_state {
+  bool enabled;
+  bool resync;              // a frame was lost, so deltas can't be trusted
+  bool hung_up;             // the device went away, e.g. it was unplugged
+
+  int bytes_in_flight;
+  int head;
+  int count;
+  int frame_bytes[FLOW_RX_BUFFER];
+  long long frame_sent_at[FLOW_RX_BUFFER];
+
+  long frames_acked;
+  long frames_rejected;
+  long timeouts;
+  long long latency_total;  // send to acknowledgement, us
+  int latency_min;
+  int latency_max;
+};
 
-      char str3[size - num_chars_cut];
-      memcpy(str3, &seq[0], size - num_chars_cut);
-   
-      stradd(str, str3, num_chars_cut + NUM_LEDS - size, size - num_chars_cut);
-    }
+/*
+ * Handle acknowledgements from the arduino, waiting up to timeout
+ * microseconds for the first one.
+ * Returns the number of frames acknowledged, or -1 if the device hung up
+ */
+int flow_read_replies(int fd, flow_state *flow, int timeout) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
 
-    offset = (offset + 1) % NUM_LEDS;
+  if (poll(&pfd, 1, timeout / 1000) <= 0) {
+    return 0;
   }
-  else {
-    offset = loop % (size + NUM_LEDS);
 
-    int num_zeroes_before = fmax(0, NUM_LEDS - offset);
+  uint8_t replies[FLOW_RX_BUFFER];
+  const int bytes_read = pfd.revents & POLLIN ? read(fd, replies, sizeof(replies)) : 0;
+  const long long now = monotonic_us();
 
-    char zeroes_before[num_zeroes_before];
-    memset(zeroes_before, '0', num_zeroes_before);
-    stradd(str, zeroes_before, 0, num_zeroes_before);
+  // it was readable, so there is no more to come
+  if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EINTR)) {
+    flow->hung_up = true;
+    return -1;
+  }
 
-    // number of characters of the string to render
-    int num_chars;
+  int num_acked = 0;
 
-    if (offset < NUM_LEDS) {
-      num_chars = offset;
-    }
-    else {
-      num_chars = fmin(NUM_LEDS, size - (offset - NUM_LEDS));
+  for (int i = 0; i < bytes_read; i++) {
+    if ((replies[i] != REPLY_ACK && replies[i] != REPLY_NAK) || flow->count == 0) {
+      continue;
     }
 
-    // cut the string at this point
-    int cut_position = fmax(0, offset - NUM_LEDS);
-
-    char cut[num_chars];
-    memcpy(cut, &seq[cut_position], num_chars);
-    stradd(str, cut, num_zeroes_before, num_chars);
+    const int latency = now - flow->frame_sent_at[flow->head];
 
-    if (NUM_LEDS > num_zeroes_before + num_chars) {
-      int num_zeroes_after = NUM_LEDS - (num_zeroes_before + num_chars);
-
-      char zeroes_after[num_zeroes_after];
-      memset(zeroes_after, '0', num_zeroes_after);
-      stradd(str, zeroes_after, num_zeroes_before + num_chars, num_zeroes_after);
+    if (flow->frames_acked + flow->frames_rejected == 0 || latency < flow->latency_min) {
+      flow->latency_min = latency;
+    }
+    if (latency > flow->latency_max) {
+      flow->latency_max = latency;
     }
+    flow->latency_total += latency;
 
-    offset = (offset + 1) % (size + NUM_LEDS);
-  }
+    if (replies[i] == REPLY_ACK) {
+      flow->frames_acked++;
+    } else {
+      flow->frames_rejected++;
+      flow->resync = true;
+    }
 
-  str[NUM_LEDS] = '\0';
+    flow->bytes_in_flight -= flow->frame_bytes[flow->head];
+    flow->head = (flow->head + 1) % FLOW_RX_BUFFER;
+    flow->count--;
 
-  set_pattern(fd, str);
+    num_acked++;
+  }
 
-  return 0;
+  return num_acked;
 }
 
 /*
- * Ping-pong ball effect
+ * Whether the arduino has room for a frame of length bytes. If not, the
+ * frame has to wait until acknowledgements come in, or until
+ * flow_retry_at() when they are overdue
  */
-int do_pong(int args[1], int _loop, char *seq) {
-  int speed_factor = 2;
-  
-  int loop = _loop * speed_factor;
-
-  const int fd = args[0];
+bool flow_has_room(int fd, flow_state *flow, int length) {
+  if (flow_read_replies(fd, flow, 0) < 0) {
+    return false;
+  }
 
-  int _offset = loop % ((NUM_LEDS - 1) * 2);
+  if (flow->count == 0 ||
+      (flow->bytes_in_flight + length <= FLOW_RX_BUFFER && flow->count < FLOW_RX_BUFFER)) {
+    return true;
+  }
 
-  int offset = _offset > NUM_LEDS - 1
-    ? ((NUM_LEDS - 1) - (_offset - (NUM_LEDS - 1))) // going backwards
-    : _offset;
+  if (monotonic_us() - flow->frame_sent_at[flow->head] >= FLOW_ACK_TIMEOUT) {
+    // acknowledgements got lost; start counting again
+    flow->timeouts++;
+    flow->resync = true;
+    flow->bytes_in_flight = 0;
+    flow->count = 0;
 
-  char str[NUM_LEDS];
+    return true;
+  }
 
-  int num_zeroes_before = offset;
-  int num_zeroes_after = NUM_LEDS - offset - 1;
+  return false;
+}
 
-  char zeroes_before[num_zeroes_before];
-  char zeroes_after[num_zeroes_after];
+long long flow_retry_at(const flow_state *flow) {
+  return flow->frame_sent_at[flow->head] + FLOW_ACK_TIMEOUT;
+}
 
-  memset(zeroes_before, '0', num_zeroes_before);
-  memset(zeroes_after, '0', num_zeroes_after);
+/*
+ * Send one complete frame, which the caller has made sure there is room
+ * for. With flow control, it is counted until it is acknowledged
+ */
+void serial_send(int fd, flow_state *flow, const uint8_t *data, int length) {
+  write(fd, data, length);
+
+  if (!flow->enabled) {
+    return;
+  }
+
+  const int tail = (flow->head + flow->count) % FLOW_RX_BUFFER;
+
+  flow->frame_bytes[tail] = length;
+  flow->frame_sent_at[tail] = monotonic_us();
+  flow->bytes_in_flight += length;
+  flow->count++;
+}
+
+/*
+ * Simple method to add one string to (part of) another
+ */
+void stradd(char *dst, char *src, int offset, int length) {
+  for (int i = offset, j = 0; j < length; i++, j++) {
+    dst[i] = src[j];
+  }
+}
+
+/*
+ * How to talk to a device, from the command line or from its line of the
+ * config file
+ */
+struct device_options {
+  // which protocol to speak to the arduino. Unless given as an option, this
+  // is picked during the handshake. The ASCII protocol is understood by
+  // every firmware version
+  int protocol;
+
+  // fastest baud rate to try during the handshake
+  int max_baud;
+
+  // ask firmware which supports it to acknowledge frames
+  bool flow_control;
+};
+
+// for every device, unless its line of the config file says otherwise
+device_options default_options = { PROTOCOL_AUTO, 1000000, true };
+
+/*
+ * Which of N LEDs are on, LED i being bit i of a single word, so that
+ * patterns are made with a few shifts and masks. They are only turned into
+ * '0'/'1' characters for the ASCII protocol
+ */
+template <int N>
+struct bit_frame {
+  static_assert(N > 0 && N <= 64, "a frame has to fit in one word");
+
+  typedef typename std::conditional<N <= 32, uint32_t, uint64_t>::type word;
+
+  static constexpr word ALL = (word)(~(uint64_t)0 >> (64 - N));
+
+  word bits;
+
+  // the first n LEDs on, as in a bar graph
+  static constexpr bit_frame bar(int n) {
+    return { n <= 0 ? (word)0 : (word)(ALL >> (N - min(n, N))) };
+  }
+
+  static constexpr bit_frame led(int i) {
+    return { (word)((word)1 << i) };
+  }
+
+  constexpr bool test(int i) const {
+    return (bits >> i) & 1;
+  }
+
+  // moves every LED n places along, and drops those which fall off the end
+  constexpr bit_frame shifted(int n) const {
+    return {
+      n >= N || n <= -N ? (word)0 :
+      n >= 0 ? (word)((bits << n) & ALL) : (word)(bits >> -n)
+    };
+  }
+
+  // moves every LED n places along, and wraps those which fall off the end
+  constexpr bit_frame rotated(int n) const {
+    return n % N == 0 ? *this : bit_frame{ (word)(shifted(n % N).bits | shifted(n % N - N).bits) };
+  }
+
+  // LED i swaps places with LED N - 1 - i
+  bit_frame reversed() const {
+    uint64_t v = bits;
+
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+
+    return { (word)(__builtin_bswap64(v) >> (64 - N)) };
+  }
+
+  constexpr bit_frame operator|(bit_frame other) const { return { (word)(bits | other.bits) }; }
+  constexpr bit_frame operator&(bit_frame other) const { return { (word)(bits & other.bits) }; }
+  constexpr bit_frame operator^(bit_frame other) const { return { (word)(bits ^ other.bits) }; }
+  constexpr bit_frame operator~() const { return { (word)(~bits & ALL) }; }
+
+  constexpr bool operator==(bit_frame other) const { return bits == other.bits; }
+  constexpr bool operator!=(bit_frame other) const { return bits != other.bits; }
+};
+
+typedef bit_frame<NUM_LEDS> led_frame;
+
+/*
+ * XOR of every byte in the frame, including the header
+ */
+uint8_t frame_checksum(uint8_t *data, int length) {
+  uint8_t checksum = 0;
+
+  for (int i = 0; i < length; i++) {
+    checksum ^= data[i];
+  }
+
+  return checksum;
+}
+
+/*
+ * Build a binary LED frame from a packed pattern.
+ * Returns the number of bytes in the frame
+ */
+int encode_binary_frame(uint32_t bits, uint8_t *data) {
+  data[0] = FRAME_LEDS_V1;
+  data[1] = bits & 0xFF;
+  data[2] = (bits >> 8) & 0xFF;
+  data[3] = (bits >> 16) & 0xFF;
+  data[4] = (bits >> 24) & 0xFF;
+  data[5] = frame_checksum(data, 5);
+
+  return FRAME_LEDS_V1_SIZE;
+}
+
+/*
+ * What the arduino should currently be showing, as far as delta frames
+ * are concerned
+ */
+struct delta_state {
+  uint32_t last_bits;
+  bool valid;
+  int frames_since_keyframe;
+};
+
+/*
+ * Encode only the LEDs which changed since the last frame, as toggle and
+ * range commands followed by DELTA_END. Falls back to a keyframe when that
+ * would be shorter, or when a resync is due.
+ * Returns the number of bytes in the frame, which is 0 if nothing changed
+ */
+int encode_delta_frame(delta_state *state, uint32_t bits, uint8_t *data) {
+  if (!state->valid || state->frames_since_keyframe >= KEYFRAME_INTERVAL) {
+    state->last_bits = bits;
+    state->valid = true;
+    state->frames_since_keyframe = 0;
+
+    return encode_binary_frame(bits, data);
+  }
+
+  const uint32_t changed = bits ^ state->last_bits;
+
+  if (changed == 0) {
+    return 0;
+  }
+
+  int length = 0;
+
+  for (int i = 0; i < NUM_LEDS; ) {
+    if (!(changed & ((uint32_t)1 << i))) {
+      i++;
+      continue;
+    }
+
+    // find the run of changed LEDs which all end up with the same value
+    const uint32_t value = (bits >> i) & 1;
+    int run = 1;
+
+    while (i + run < NUM_LEDS &&
+        ((changed >> (i + run)) & 1) &&
+        ((bits >> (i + run)) & 1) == value) {
+      run++;
+    }
+
+    const int cost = run < DELTA_RANGE_SIZE ? run : DELTA_RANGE_SIZE;
+
+    if (length + cost + 1 >= FRAME_LEDS_V1_SIZE) {
+      // the delta would be no smaller than a keyframe
+      state->frames_since_keyframe = KEYFRAME_INTERVAL;
+
+      return encode_delta_frame(state, bits, data);
+    }
+
+    if (run < DELTA_RANGE_SIZE) {
+      for (int j = 0; j < run; j++) {
+        data[length++] = DELTA_TOGGLE | (i + j);
+      }
+    }
+    else {
+      data[length++] = DELTA_RANGE;
+      data[length++] = i;
+      data[length++] = run | (value << 7);
+    }
+
+    i += run;
+  }
+
+  data[length++] = DELTA_END;
+
+  state->last_bits = bits;
+  state->frames_since_keyframe++;
+
+  return length;
+}
+
+/*
+ * Mailbox between one producer and one consumer which only keeps the
+ * newest value. It is triple buffered, so neither side ever waits for the
+ * other, and a value which is overwritten before it was taken is dropped
+ */
+template <typename T>
+struct latest_slot {
+  static const int FRESH = 4;
+
+  T buffers[3];
+  std::atomic<int> middle;  // index of the buffer in between, | FRESH if not taken yet
+  int back;                 // the producer's buffer
+  int front;                // the consumer's buffer
+
+  latest_slot() : middle(1), back(0), front(2) {}
+
+  void publish(const T &value) {
+    buffers[back] = value;
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+  }
+
+  bool take(T *value) {
+    if (!(middle.load(std::memory_order_acquire) & FRESH)) {
+      return false;
+    }
+
+    front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+    *value = buffers[front];
+
+    return true;
+  }
+};
+
+struct display_frame {
+  char pattern[10];
+};
+
+#define DISPLAY_FRAME_SIZE 11
+
+/*
+ * Owns a serial device. Patterns are handed over through one mailbox
+ * per channel and written out by the I/O thread, so that the tasks
+ * never wait for the serial port. Under backpressure, the device skips
+ * straight to the newest frame
+ */
+struct serial_writer {
+  const char *name;
+  int index;                // in the order the devices were opened
+  int fd;
+  int wake_fd;              // eventfd, signalled when a frame is published
+  int protocol;
+
+  latest_slot<led_frame> leds;
+  latest_slot<display_frame> display;
+
+  std::atomic<long> frames_published{0};
+  long frames_written = 0;
+  long frames_unchanged = 0;  // not written, as the device already shows them
+  long frames_resent = 0;     // written again, after one was lost
+  bool dead = false;          // hung up, so frames are dropped from then on
+
+  // what the device was last sent, and whether it still has to be
+  led_frame leds_sent;
+  display_frame display_sent;
+  bool has_leds = false;
+  bool has_display = false;
+  bool leds_pending = false;
+  bool display_pending = false;
+
+  delta_state delta = { 0, false, 0 };
+  flow_state flow = {};
+
+  // without flow control, when the arduino should have room again
+  long long ready_at = 0;
+
+  // to try again once the device has room
+  loop_timer retry = {};
+  bool retry_armed = false;
+
+  fd_watch wake_watch;
+  fd_watch serial_watch;
+};
+
+// enough for a rack of boards on one host
+#define MAX_WRITERS 64
+
+serial_writer *writers[MAX_WRITERS];
+int num_writers = 0;
+
+/** Recording */
+/*
+ * --record=FILE appends every frame written to the devices to FILE, and
+ * --replay=FILE plays one back. The file is a header then a record per
+ * frame, all RECORD_SIZE bytes, so that it can be mapped and walked
+ * through without reading it in, however big it gets
+ */
+#define RECORD_MAGIC "LEDSREC"
+#define RECORD_VERSION 1
+#define RECORD_SIZE 32
+#define RECORD_PAYLOAD 16
+#define RECORD_BUFFER 128               // records written out at a time
+#define RECORD_FLUSH_INTERVAL 1000000   // us, longest a record is held back
+
+// what a record holds
+#define RECORD_START 0      // a new recording was appended, so times start again
+#define RECORD_LEDS 1       // LED i is bit i of the payload
+#define RECORD_DISPLAY 2    // the display pattern
+
+struct record_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t num_leds;
+  uint8_t reserved[12];
+};
+
+struct frame_record {
+  uint64_t time;          // CLOCK_MONOTONIC, ns
+  uint8_t channel;
+  uint8_t device;         // serial_writer::index
+  uint8_t reserved[6];
+  uint8_t payload[RECORD_PAYLOAD];
+};
+
+static_assert(sizeof(record_header) == RECORD_SIZE && sizeof(frame_record) == RECORD_SIZE,
+  "records have to stay the same size as the header");
+static_assert(NUM_LEDS <= 64, "LED frames are recorded as one 64 bit word");
+
+/*
+ * Records are only written by whichever thread is writing the frames,
+ * and are written out in batches. A timer on that thread's event loop
+ * writes out whatever is left once the devices go quiet
+ */
+struct recorder {
+  int fd;
+  frame_record buffer[RECORD_BUFFER];
+  int count;
+  long long flushed_at;   // us
+  long records;
+  loop_timer flush_timer;
+};
+
+recorder recording = { -1, {}, 0, 0, 0, {} };
+
+void flush_recording() {
+  if (recording.fd < 0 || recording.count == 0) {
+    return;
+  }
+
+  const ssize_t length = recording.count * RECORD_SIZE;
+
+  if (write(recording.fd, recording.buffer, length) != length) {
+    printf("error %d writing the recording, stopping it\n", errno);
+    close(recording.fd);
+    recording.fd = -1;
+  }
+
+  recording.count = 0;
+  recording.flushed_at = monotonic_us();
+}
+
+void flush_recording_tick(void *data, long long now) {
+  if (now - recording.flushed_at >= RECORD_FLUSH_INTERVAL) {
+    flush_recording();
+  }
+}
+
+void record_frame(int channel, int device, const uint8_t *payload) {
+  if (recording.fd < 0) {
+    return;
+  }
+
+  frame_record *record = &recording.buffer[recording.count++];
+
+  memset(record, 0, sizeof(frame_record));
+  record->time = monotonic_ns();
+  record->channel = channel;
+  record->device = device;
+
+  if (payload != NULL) {
+    memcpy(record->payload, payload, RECORD_PAYLOAD);
+  }
+
+  recording.records++;
+
+  if (recording.count == RECORD_BUFFER ||
+      monotonic_us() - recording.flushed_at >= RECORD_FLUSH_INTERVAL) {
+    flush_recording();
+  }
+}
+
+void record_leds(int device, led_frame frame) {
+  uint8_t payload[RECORD_PAYLOAD] = {};
+
+  for (int i = 0; i < 8; i++) {
+    payload[i] = (uint64_t)frame.bits >> (i * 8);
+  }
+
+  record_frame(RECORD_LEDS, device, payload);
+}
+
+void record_display(int device, const display_frame *frame) {
+  uint8_t payload[RECORD_PAYLOAD] = {};
+
+  memcpy(payload, frame->pattern, sizeof(frame->pattern));
+
+  record_frame(RECORD_DISPLAY, device, payload);
+}
+
+bool valid_record_header(const record_header *header) {
+  return !memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)) &&
+    header->version == RECORD_VERSION &&
+    header->record_size == RECORD_SIZE &&
+    header->num_leds == NUM_LEDS;
+}
+
+/*
+ * Start appending to a recording, creating it if it is new. It is
+ * flushed from loop, which has to be the one the frames are written from
+ */
+int open_recording(const char *path, event_loop *loop) {
+  const int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("error %d opening %s: %s\n", errno, path, strerror(errno));
+    return -1;
+  }
+
+  if (st.st_size == 0) {
+    record_header header;
+    memset(&header, 0, sizeof(header));
+
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.version = RECORD_VERSION;
+    header.record_size = RECORD_SIZE;
+    header.num_leds = NUM_LEDS;
+
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+      printf("error %d writing %s\n", errno, path);
+      close(fd);
+      return -1;
+    }
+  }
+  else {
+    record_header header;
+
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || !valid_record_header(&header)) {
+      printf("%s isn't a recording we can append to!\n", path);
+      close(fd);
+      return -1;
+    }
+
+    // drop what is left of a record which was cut short
+    if (st.st_size % RECORD_SIZE != 0 && ftruncate(fd, st.st_size - st.st_size % RECORD_SIZE) != 0) {
+      printf("error %d truncating %s\n", errno, path);
+      close(fd);
+      return -1;
+    }
+  }
+
+  recording.fd = fd;
+  recording.count = 0;
+  recording.flushed_at = monotonic_us();
+
+  recording.flush_timer.due = recording.flushed_at + RECORD_FLUSH_INTERVAL;
+  recording.flush_timer.interval = RECORD_FLUSH_INTERVAL;
+  recording.flush_timer.callback = flush_recording_tick;
+
+  event_loop_add_timer(loop, &recording.flush_timer);
+
+  record_frame(RECORD_START, 0, NULL);
+
+  return 0;
+}
+
+void close_recording() {
+  if (recording.fd < 0) {
+    return;
+  }
+
+  flush_recording();
+  close(recording.fd);
+  recording.fd = -1;
+}
+
+/*
+ * Every device is written to by one thread, which sleeps in one event loop
+ * until a frame is published, an acknowledgement arrives, or a device
+ * which was busy has room again. Nothing ever blocks on one device, so
+ * dozens of them can share the thread
+ */
+struct io_thread {
+  event_loop loop;
+  int stop_fd;
+  fd_watch stop_watch;
+  std::thread thread;
+};
+
+io_thread io;
+
+serial_writer *writer_for_fd(int fd) {
+  for (int i = 0; i < num_writers; i++) {
+    if (writers[i]->fd == fd) {
+      return writers[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Whether the device can take a frame of length bytes now
+ */
+bool writer_has_room(serial_writer *writer, int length) {
+  if (writer->flow.enabled) {
+    return flow_has_room(writer->fd, &writer->flow, length);
+  }
+
+  return monotonic_us() >= writer->ready_at;
+}
+
+/*
+ * Send a frame. Without flow control, we then leave the arduino
+ * legacy_delay microseconds, which is a guess at how long it needs to
+ * handle it
+ */
+void writer_send(serial_writer *writer, const uint8_t *data, int length, int legacy_delay) {
+  serial_send(writer->fd, &writer->flow, data, length);
+
+  if (!writer->flow.enabled) {
+    writer->ready_at = monotonic_us() + legacy_delay;
+  }
+}
+
+// the most a LED frame can take up
+int led_frame_size(serial_writer *writer) {
+  return writer->protocol == PROTOCOL_ASCII ? NUM_LEDS + 2 : FRAME_LEDS_V1_SIZE;
+}
+
+void write_display(serial_writer *writer, const display_frame *frame) {
+  char data[DISPLAY_FRAME_SIZE];
+
+  data[0] = 'c'; // send begin command to arduino
+
+  memcpy(data + 1, frame->pattern, 10);
+
+  // for words, the arduino ignores everything after the first character
+  const int length = frame->pattern[0] >= '0' && frame->pattern[0] <= '9' ? DISPLAY_FRAME_SIZE : 2;
+
+  writer_send(writer, (uint8_t *)data, length, (5 + 25) * 100);
+}
+
+void write_pattern(serial_writer *writer, led_frame frame) {
+  if (writer->protocol == PROTOCOL_DELTA) {
+    uint8_t data[FRAME_LEDS_V1_SIZE];
+
+    int length = encode_delta_frame(&writer->delta, frame.bits, data);
+
+    if (length > 0) {
+      writer_send(writer, data, length, (length + 25) * 100);
+    }
+
+    return;
+  }
+
+  if (writer->protocol == PROTOCOL_BINARY) {
+    uint8_t data[FRAME_LEDS_V1_SIZE];
+
+    int length = encode_binary_frame(frame.bits, data);
+
+    writer_send(writer, data, length, (length + 25) * 100);
+
+    return;
+  }
+
+  char data[NUM_LEDS + 2];
+
+  data[0] = 'b';              // send begin command to arduino
+  data[NUM_LEDS + 1] = 'e';   // send end command to arduino
+
+  for (int i = 0; i < NUM_LEDS; i++) {
+    data[i + 1] = frame.test(i) ? '1' : '0';
+  }
+
+  writer_send(writer, (uint8_t *)data, NUM_LEDS + 2, (NUM_LEDS + 2 + 25) * 100);
+}
+
+void writer_retry(void *data, long long now);
+
+/*
+ * Stop watching a device which has gone away, so that its hangup doesn't
+ * keep waking the I/O thread
+ */
+void writer_hang_up(serial_writer *writer) {
+  if (writer->dead) {
+    return;
+  }
+
+  writer->dead = true;
+  event_loop_unwatch(&io.loop, &writer->serial_watch);
+
+  printf("%s: Device disconnected!\n", writer->name);
+}
+
+/*
+ * Come back when the device should have room. With flow control, an
+ * acknowledgement usually gets us going again before then
+ */
+void writer_wait(serial_writer *writer) {
+  if (writer->flow.hung_up) {
+    // there won't be room again
+    writer_hang_up(writer);
+    return;
+  }
+
+  if (writer->retry_armed) {
+    // it can only be due sooner than we need, and then this is called again
+    return;
+  }
+
+  writer->retry.due = writer->flow.enabled ? flow_retry_at(&writer->flow) : writer->ready_at;
+  writer->retry.interval = 0;
+  writer->retry.callback = writer_retry;
+  writer->retry.data = writer;
+  writer->retry_armed = true;
+
+  event_loop_add_timer(&io.loop, &writer->retry);
+}
+
+/*
+ * Write out the newest frames, if there are any new ones which the device
+ * isn't already showing, and it has room for them
+ */
+void writer_flush(serial_writer *writer) {
+  led_frame leds;
+  display_frame display;
+
+  if (writer->leds.take(&leds)) {
+    if (writer->has_leds && leds == writer->leds_sent) {
+      writer->frames_unchanged++;
+    }
+    else {
+      writer->leds_sent = leds;
+      writer->has_leds = true;
+      writer->leds_pending = true;
+    }
+  }
+
+  if (writer->display.take(&display)) {
+    if (writer->has_display && !memcmp(&display, &writer->display_sent, sizeof(display))) {
+      writer->frames_unchanged++;
+    }
+    else {
+      writer->display_sent = display;
+      writer->has_display = true;
+      writer->display_pending = true;
+    }
+  }
+
+  if (writer->flow.resync) {
+    // a frame was lost, so we can't be sure what the device is showing
+    writer->flow.resync = false;
+    writer->delta.valid = false;
+
+    if (writer->has_leds && !writer->leds_pending) {
+      writer->leds_pending = true;
+      writer->frames_resent++;
+    }
+
+    if (writer->has_display && !writer->display_pending) {
+      writer->display_pending = true;
+      writer->frames_resent++;
+    }
+  }
+
+  if (writer->flow.hung_up) {
+    writer_hang_up(writer);
+  }
+
+  if (writer->dead) {
+    return;
+  }
+
+  if (writer->leds_pending) {
+    if (!writer_has_room(writer, led_frame_size(writer))) {
+      writer_wait(writer);
+      return;
+    }
+
+    writer->leds_pending = false;
+    write_pattern(writer, writer->leds_sent);
+    writer->frames_written++;
+
+    record_leds(writer->index, writer->leds_sent);
+  }
+
+  if (writer->display_pending) {
+    if (!writer_has_room(writer, DISPLAY_FRAME_SIZE)) {
+      writer_wait(writer);
+      return;
+    }
+
+    writer->display_pending = false;
+    write_display(writer, &writer->display_sent);
+    writer->frames_written++;
+
+    record_display(writer->index, &writer->display_sent);
+  }
+}
+
+void writer_retry(void *data, long long now) {
+  serial_writer *writer = (serial_writer *)data;
+
+  writer->retry_armed = false;
+
+  writer_flush(writer);
+}
+
+void writer_wake(void *data) {
+  serial_writer *writer = (serial_writer *)data;
+
+  uint64_t count;
+  read(writer->wake_fd, &count, sizeof(count));
+
+  writer_flush(writer);
+}
+
+/*
+ * Acknowledgements are handled as soon as they arrive, so that their
+ * latency is accurate, and so that frames waiting for room go out
+ */
+void writer_serial_readable(void *data) {
+  serial_writer *writer = (serial_writer *)data;
+
+  if (flow_read_replies(writer->fd, &writer->flow, 0) < 0) {
+    writer_hang_up(writer);
+    return;
+  }
+
+  if (writer->flow.resync || writer->leds_pending || writer->display_pending) {
+    writer_flush(writer);
+  }
+}
+
+int init_io() {
+  if (event_loop_init(&io.loop) != 0) {
+    return -1;
+  }
+
+  io.stop_fd = eventfd(0, EFD_CLOEXEC);
+  io.stop_watch = { io.stop_fd, stop_event_loop, &io.loop };
+
+  if (io.stop_fd < 0 || event_loop_watch(&io.loop, &io.stop_watch) != 0) {
+    printf("error %d creating eventfd\n", errno);
+    return -1;
+  }
+
+  return 0;
+}
+
+serial_writer *create_writer(const char *name, int fd) {
+  if (num_writers == MAX_WRITERS) {
+    printf("Too many devices!\n");
+    return NULL;
+  }
+
+  serial_writer *writer = new serial_writer();
+
+  writer->name = name;
+  writer->fd = fd;
+  writer->protocol = PROTOCOL_AUTO;
+  writer->wake_fd = eventfd(0, EFD_CLOEXEC);
+
+  if (writer->wake_fd < 0) {
+    printf("error %d creating eventfd\n", errno);
+    delete writer;
+    return NULL;
+  }
+
+  writer->wake_watch = { writer->wake_fd, writer_wake, writer };
+  writer->serial_watch = { fd, writer_serial_readable, writer };
+
+  if (event_loop_watch(&io.loop, &writer->wake_watch) != 0) {
+    delete writer;
+    return NULL;
+  }
+
+  writer->index = num_writers;
+  writers[num_writers++] = writer;
+
+  return writer;
+}
+
+void start_writer(serial_writer *writer) {
+  // only once the handshake is done with the port
+  event_loop_watch(&io.loop, &writer->serial_watch);
+}
+
+void start_io() {
+  io.thread = std::thread(event_loop_run, &io.loop);
+}
+
+void wake_writer(serial_writer *writer) {
+  const uint64_t one = 1;
+
+  write(writer->wake_fd, &one, sizeof(one));
+}
+
+/*
+ * Write out what is still waiting to be sent, waiting as long as the
+ * device needs for it. Only once the I/O thread has stopped
+ */
+void drain_writer(serial_writer *writer) {
+  writer_flush(writer);
+
+  while (!writer->dead && (writer->leds_pending || writer->display_pending)) {
+    if (writer->flow.enabled) {
+      flow_read_replies(writer->fd, &writer->flow, FLOW_ACK_TIMEOUT);
+    }
+    else {
+      usleep(max(writer->ready_at - monotonic_us(), 0LL));
+    }
+
+    writer_flush(writer);
+  }
+}
+
+/*
+ * Stop the I/O thread, then write out anything still waiting to be sent
+ */
+void stop_io() {
+  const uint64_t one = 1;
+  write(io.stop_fd, &one, sizeof(one));
+
+  io.thread.join();
+
+  for (int i = 0; i < num_writers; i++) {
+    drain_writer(writers[i]);
+  }
+}
+
+void set_display(int fd, const char *pattern) {
+  serial_writer *writer = writer_for_fd(fd);
+
+  display_frame frame;
+  memcpy(frame.pattern, pattern, 10);
+
+  writer->display.publish(frame);
+  writer->frames_published++;
+
+  wake_writer(writer);
+}
+
+/*
+ * This is a method used by other functions to tell the arduino
+ * which LEDs to light up
+ */
+void set_pattern(int fd, led_frame frame) {
+  serial_writer *writer = writer_for_fd(fd);
+
+  writer->leds.publish(frame);
+  writer->frames_published++;
+
+  wake_writer(writer);
+}
+
+/*
+ * What we found out about the device during the handshake
+ */
+struct link_info {
+  int version;        // firmware protocol version, 0 for firmware without a handshake
+  int caps;
+  int max_baud_index;
+  int baud;
+  int ping_min;       // round trip times, us
+  int ping_max;
+  long long ping_total;
+  int pings;
+  int fallbacks;
+};
+
+// indices are shared with the firmware
+const int baud_rates[] = { 9600, 115200, 250000, 500000, 1000000 };
+#define NUM_BAUD_RATES (int)(sizeof(baud_rates) / sizeof(baud_rates[0]))
+
+/*
+ * Wait for a "LEDS <version> <caps> <max baud index>" line, which the
+ * firmware sends when it boots and in reply to CMD_VERSION
+ */
+bool read_version_line(int fd, link_info *link, int timeout) {
+  const long long deadline = monotonic_us() + timeout;
+
+  char line[64];
+  int length = 0;
+
+  while (monotonic_us() < deadline) {
+    uint8_t c;
+
+    if (serial_read(fd, &c, 1, deadline - monotonic_us()) != 1) {
+      break;
+    }
+
+    if (c != '\n') {
+      if (length < (int)sizeof(line) - 1) {
+        line[length++] = c;
+      }
+      continue;
+    }
+
+    line[length] = '\0';
+    length = 0;
+
+    if (sscanf(line, "LEDS %d %x %d",
+          &link->version, &link->caps, &link->max_baud_index) == 3) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool query_version(int fd, link_info *link) {
+  for (int i = 0; i < HANDSHAKE_VERSION_RETRIES; i++) {
+    const uint8_t command = CMD_VERSION;
+
+    tcflush(fd, TCIFLUSH);
+    write(fd, &command, 1);
+
+    if (read_version_line(fd, link, HANDSHAKE_REPLY_TIMEOUT)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Ping the firmware BAUD_PING_COUNT times, recording round trip times.
+ * The first ping also confirms a new baud rate to the firmware
+ */
+bool ping_device(int fd, link_info *link) {
+  for (int i = 0; i < BAUD_PING_COUNT; i++) {
+    const uint8_t command = CMD_PING;
+    uint8_t reply;
+
+    const long long start = monotonic_us();
+
+    write(fd, &command, 1);
+
+    if (serial_read(fd, &reply, 1, HANDSHAKE_REPLY_TIMEOUT) != 1 || reply != REPLY_PING) {
+      return false;
+    }
+
+    const int rtt = monotonic_us() - start;
+
+    if (link->pings == 0 || rtt < link->ping_min) {
+      link->ping_min = rtt;
+    }
+    if (rtt > link->ping_max) {
+      link->ping_max = rtt;
+    }
+
+    link->ping_total += rtt;
+    link->pings++;
+  }
+
+  return true;
+}
+
+/*
+ * Ask the firmware to switch to baud_rates[index], follow it and check the
+ * link works. On failure both sides end up back at 9600
+ */
+bool try_baud_rate(int fd, int index, link_info *link) {
+  const uint8_t command[2] = { CMD_BAUD, (uint8_t)index };
+  uint8_t reply[2];
+
+  tcflush(fd, TCIFLUSH);
+  write(fd, command, 2);
+
+  if (serial_read(fd, reply, 2, HANDSHAKE_REPLY_TIMEOUT) != 2 ||
+      reply[0] != CMD_BAUD || reply[1] != index) {
+    // the firmware didn't switch
+    return false;
+  }
+
+  tcdrain(fd);
+  set_baud_rate(fd, baud_rates[index]);
+  usleep(BAUD_SWITCH_SETTLE);
+  tcflush(fd, TCIOFLUSH);
+
+  link->pings = 0;
+  link->ping_total = 0;
+  link->ping_max = 0;
+
+  if (ping_device(fd, link)) {
+    link->baud = baud_rates[index];
+    return true;
+  }
+
+  printf("%d baud link is unreliable, falling back\n", baud_rates[index]);
+  link->fallbacks++;
+
+  // in case the firmware did get a ping, tell it to go back to 9600 too
+  const uint8_t revert[2] = { CMD_BAUD, 0 };
+  write(fd, revert, 2);
+  tcdrain(fd);
+
+  set_baud_rate(fd, baud_rates[0]);
+  usleep(BAUD_CONFIRM_TIMEOUT + BAUD_SWITCH_SETTLE);
+  tcflush(fd, TCIOFLUSH);
+
+  return false;
+}
+
+/*
+ * Find out what the firmware supports and agree on the fastest baud rate
+ * (up to max_baud) which works. Firmware which doesn't answer is assumed
+ * to only speak ASCII at 9600 baud
+ */
+void handshake(serial_writer *writer, const device_options *options, link_info *link) {
+  const int fd = writer->fd;
+  flow_state *flow = &writer->flow;
+
+  writer->protocol = options->protocol;
+
+  memset(link, 0, sizeof(link_info));
+  link->baud = baud_rates[0];
+
+  const long long start = monotonic_us();
+
+  if (!read_version_line(fd, link, HANDSHAKE_BOOT_TIMEOUT) && !query_version(fd, link)) {
+    printf("%s: No handshake from firmware, assuming ASCII protocol at 9600 baud\n", writer->name);
+
+    if (writer->protocol == PROTOCOL_AUTO) {
+      writer->protocol = PROTOCOL_ASCII;
+    }
+    return;
+  }
+
+  printf("%s: Firmware protocol v%d, capabilities 0x%02x\n", writer->name, link->version, link->caps);
+
+  if (writer->protocol == PROTOCOL_AUTO) {
+    if (link->caps & CAP_DELTA) {
+      writer->protocol = PROTOCOL_DELTA;
+    } else if (link->caps & CAP_BINARY) {
+      writer->protocol = PROTOCOL_BINARY;
+    } else {
+      writer->protocol = PROTOCOL_ASCII;
+    }
+  }
+
+  if (link->caps & CAP_BAUD) {
+    for (int i = min(link->max_baud_index, NUM_BAUD_RATES - 1); i > 0; i--) {
+      if (baud_rates[i] <= options->max_baud && try_baud_rate(fd, i, link)) {
+        break;
+      }
+    }
+  }
+
+  if (link->pings == 0) {
+    ping_device(fd, link);
+  }
+
+  if ((link->caps & CAP_ACK) && options->flow_control) {
+    const uint8_t command = CMD_FLOW_ON;
+    uint8_t reply;
+
+    write(fd, &command, 1);
+
+    flow->enabled = serial_read(fd, &reply, 1, HANDSHAKE_REPLY_TIMEOUT) == 1 && reply == REPLY_ACK;
+  }
+
+  printf(
+    "%s: Link: %d baud, protocol %s, flow control %s, ping %d/%lld/%d us (min/avg/max), %d fallback(s), handshake took %lld ms\n",
+    writer->name,
+    link->baud,
+    writer->protocol == PROTOCOL_DELTA ? "delta" : writer->protocol == PROTOCOL_BINARY ? "binary" : "ascii",
+    flow->enabled ? "on" : "off",
+    link->ping_min,
+    link->pings > 0 ? link->ping_total / link->pings : 0,
+    link->ping_max,
+    link->fallbacks,
+    (monotonic_us() - start) / 1000
+  );
+}
+
+/** /proc and sysfs readers */
+// the cpu lines of MAX_CPUS cores at up to 128 bytes each, and the rest
+#define PROC_STAT_BUFFER (MAX_CPUS * 128 + 4096)
+#define PROC_MEMINFO_BUFFER 8192
+#define PROC_SMALL_BUFFER 256
+
+/*
+ * A /proc or sysfs file which is opened once, then re-read from the start
+ * with pread() into a buffer which is allocated on the first read. If the
+ * file goes away (e.g. a hwmon driver is reloaded), it is opened again
+ */
+struct proc_reader {
+  const char *path;
+  int size;
+  int fd;
+  char *buf;
+};
+
+#define PROC_READER(path, size) { path, size, -1, NULL }
+
+int proc_reader_open(proc_reader *reader) {
+  reader->fd = open(reader->path, O_RDONLY | O_CLOEXEC);
+
+  return reader->fd;
+}
+
+void proc_reader_close(proc_reader *reader) {
+  if (reader->fd >= 0) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+}
+
+/*
+ * Read the whole file (up to size - 1 bytes) into reader->buf, and
+ * null-terminate it. Returns the number of bytes read, or -1
+ */
+int proc_reader_read(proc_reader *reader) {
+  if (reader->buf == NULL) {
+    reader->buf = (char *)malloc(reader->size);
+
+    if (reader->buf == NULL) {
+      return -1;
+    }
+  }
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (reader->fd < 0 && proc_reader_open(reader) < 0) {
+      return -1;
+    }
+
+    const ssize_t bytes_read = pread(reader->fd, reader->buf, reader->size - 1, 0);
+
+    if (bytes_read >= 0) {
+      reader->buf[bytes_read] = '\0';
+
+      return bytes_read;
+    }
+
+    // the file was removed or its driver went away; try opening it again
+    proc_reader_close(reader);
+  }
+
+  return -1;
+}
+
+/*
+ * Field scanners for /proc files. These replace scanf, which re-parses a
+ * format string and (for sscanf) runs strlen over the whole buffer on every
+ * call, and which gets the wrong answer if the kernel adds or moves fields
+ */
+
+/*
+ * Skip spaces, then read an unsigned decimal number, leaving *p just after
+ * it. Returns false, leaving *p alone, if there isn't a number there
+ */
+inline bool scan_ulong(const char **p, long unsigned int *value) {
+  const char *c = *p;
+
+  while (*c == ' ' || *c == '\t') {
+    c++;
+  }
+
+  if (*c < '0' || *c > '9') {
+    return false;
+  }
+
+  long unsigned int result = 0;
+
+  while (*c >= '0' && *c <= '9') {
+    result = result * 10 + (*c - '0');
+    c++;
+  }
+
+  *value = result;
+  *p = c;
+
+  return true;
+}
+
+inline const char *next_line(const char *p) {
+  const char *end = strchr(p, '\n');
+
+  return end != NULL ? end + 1 : p + strlen(p);
+}
+
+/*
+ * Read the numbers following the label at the start of a line, e.g.
+ * "cpu0 1 2 3 ...", however many the kernel gives us (up to max_fields).
+ * Returns the number of fields read
+ */
+int scan_stat_fields(const char *line, long unsigned int *fields, int max_fields) {
+  const char *p = line;
+
+  while (*p != ' ' && *p != '\n' && *p != '\0') {
+    p++;
+  }
+
+  int num_fields = 0;
+
+  while (num_fields < max_fields && scan_ulong(&p, &fields[num_fields])) {
+    num_fields++;
+  }
+
+  return num_fields;
+}
+
+/* Backend functions */
+
+/** Temperature sensors */
+#ifndef SYSFS_CLASS_DIR
+#define SYSFS_CLASS_DIR "/sys/class"
+#endif
+
+#define MAX_SENSORS 64
+#define NUM_DISPLAY_SENSORS 2
+
+/*
+ * A temperature input found under /sys/class/hwmon or /sys/class/thermal,
+ * named "<chip>:<label>", e.g. "coretemp:Core 0" or "thermal:x86_pkg_temp".
+ * Its file stays open from discovery onwards
+ */
+struct temp_sensor {
+  char name[96];
+  char path[PATH_MAX];
+  proc_reader reader;
+};
+
+struct sensor_index {
+  int num_sensors;
+  temp_sensor sensors[MAX_SENSORS];
+};
+
+sensor_index sensors = {};
+
+// sensors shown by do_temps, chosen with --sensor or the first ones found
+const char *sensor_names[NUM_DISPLAY_SENSORS];
+int num_sensor_names = 0;
+temp_sensor *display_sensors[NUM_DISPLAY_SENSORS];
+
+/*
+ * Read a one line sysfs attribute (e.g. a chip name) without the newline
+ */
+bool read_sysfs_string(const char *path, char *buf, int size) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    return false;
+  }
+
+  const ssize_t bytes_read = read(fd, buf, size - 1);
+  close(fd);
+
+  if (bytes_read <= 0) {
+    return false;
+  }
+
+  buf[bytes_read] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+
+  return true;
+}
+
+void add_sensor(sensor_index *index, const char *chip, const char *label, const char *path) {
+  if (index->num_sensors == MAX_SENSORS) {
+    return;
+  }
+
+  temp_sensor *sensor = &index->sensors[index->num_sensors];
+
+  snprintf(sensor->name, sizeof(sensor->name), "%s:%s", chip, label);
+
+  snprintf(sensor->path, sizeof(sensor->path), "%s", path);
+
+  sensor->reader = PROC_READER(sensor->path, PROC_SMALL_BUFFER);
+
+  if (proc_reader_open(&sensor->reader) >= 0) {
+    index->num_sensors++;
+  }
+}
+
+int filter_hwmon(const struct dirent *entry) {
+  return strncmp(entry->d_name, "hwmon", 5) == 0;
+}
+
+int filter_thermal_zone(const struct dirent *entry) {
+  return strncmp(entry->d_name, "thermal_zone", 12) == 0;
+}
+
+int filter_temp_input(const struct dirent *entry) {
+  const char *name = entry->d_name;
+  const size_t length = strlen(name);
+
+  return strncmp(name, "temp", 4) == 0 && length > 10 && strcmp(name + length - 6, "_input") == 0;
+}
+
+/*
+ * snprintf() for a PATH_MAX buffer. Returns false if it didn't fit, as a
+ * truncated path would be some other file
+ */
+bool format_path(char *path, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+bool format_path(char *path, const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  const int length = vsnprintf(path, PATH_MAX, format, args);
+  va_end(args);
+
+  return length >= 0 && length < PATH_MAX;
+}
+
+/*
+ * Scan hwmon chips and thermal zones once, in a stable order (hwmon2
+ * before hwmon10), so that sensors can be picked by name however the
+ * kernel happened to number them this boot
+ */
+void discover_sensors(sensor_index *index) {
+  struct dirent **chips;
+  char path[PATH_MAX];
+
+  const int num_chips = scandir(SYSFS_CLASS_DIR "/hwmon", &chips, filter_hwmon, versionsort);
+
+  for (int i = 0; i < num_chips; i++) {
+    char dir[PATH_MAX];
+    char chip[NAME_MAX + 1];
+
+    if (!format_path(dir, SYSFS_CLASS_DIR "/hwmon/%s", chips[i]->d_name)) {
+      free(chips[i]);
+      continue;
+    }
+
+    if (!format_path(path, "%s/name", dir) || !read_sysfs_string(path, chip, sizeof(chip))) {
+      snprintf(chip, sizeof(chip), "%s", chips[i]->d_name);
+    }
+
+    struct dirent **inputs;
+    const int num_inputs = scandir(dir, &inputs, filter_temp_input, versionsort);
+
+    for (int j = 0; j < num_inputs; j++) {
+      // tempN_input is labelled by tempN_label, if the driver knows better
+      char label[NAME_MAX + 1];
+      const int prefix_length = strlen(inputs[j]->d_name) - 6;
+
+      if (!format_path(path, "%s/%.*s_label", dir, prefix_length, inputs[j]->d_name) ||
+          !read_sysfs_string(path, label, sizeof(label))) {
+        snprintf(label, sizeof(label), "%.*s", prefix_length, inputs[j]->d_name);
+      }
+
+      if (format_path(path, "%s/%s", dir, inputs[j]->d_name)) {
+        add_sensor(index, chip, label, path);
+      }
+
+      free(inputs[j]);
+    }
+
+    if (num_inputs >= 0) {
+      free(inputs);
+    }
+
+    free(chips[i]);
+  }
+
+  if (num_chips >= 0) {
+    free(chips);
+  }
+
+  struct dirent **zones;
+  const int num_zones = scandir(SYSFS_CLASS_DIR "/thermal", &zones, filter_thermal_zone, versionsort);
+
+  for (int i = 0; i < num_zones; i++) {
+    char type[NAME_MAX + 1];
+
+    if (!format_path(path, SYSFS_CLASS_DIR "/thermal/%s/type", zones[i]->d_name) ||
+        !read_sysfs_string(path, type, sizeof(type))) {
+      snprintf(type, sizeof(type), "%s", zones[i]->d_name);
+    }
+
+    if (format_path(path, SYSFS_CLASS_DIR "/thermal/%s/temp", zones[i]->d_name)) {
+      add_sensor(index, "thermal", type, path);
+    }
+
+    free(zones[i]);
+  }
+
+  if (num_zones >= 0) {
+    free(zones);
+  }
+}
+
+/*
+ * Find a sensor by its full name, or failing that by its label alone
+ */
+temp_sensor *find_sensor(sensor_index *index, const char *name) {
+  for (int i = 0; i < index->num_sensors; i++) {
+    if (!strcmp(index->sensors[i].name, name)) {
+      return &index->sensors[i];
+    }
+  }
+
+  for (int i = 0; i < index->num_sensors; i++) {
+    const char *label = strchr(index->sensors[i].name, ':');
+
+    if (label != NULL && !strcmp(label + 1, name)) {
+      return &index->sensors[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Discover the sensors and pick the ones to display.
+ * Returns -1 if a sensor asked for doesn't exist
+ */
+int init_sensors() {
+  static bool initialised = false;
+
+  if (initialised) {
+    // for the temps task of another device
+    return 0;
+  }
+
+  initialised = true;
+
+  discover_sensors(&sensors);
+
+  for (int i = 0; i < NUM_DISPLAY_SENSORS; i++) {
+    if (i < num_sensor_names) {
+      display_sensors[i] = find_sensor(&sensors, sensor_names[i]);
+
+      if (display_sensors[i] == NULL) {
+        printf("No sensor called %s! Use --list-sensors to see them\n", sensor_names[i]);
+        return -1;
+      }
+    }
+    else {
+      display_sensors[i] = i < sensors.num_sensors ? &sensors.sensors[i] : NULL;
+    }
+  }
+
+  if (display_sensors[0] == NULL) {
+    printf("No temperature sensors found!\n");
+  }
+
+  return 0;
+}
+
+void list_sensors() {
+  discover_sensors(&sensors);
+
+  for (int i = 0; i < sensors.num_sensors; i++) {
+    printf("%s\t%s\n", sensors.sensors[i].name, sensors.sensors[i].path);
+  }
+}
+
+/**
+ * Get the temperature of each displayed sensor, in degrees C. Slots with
+ * no sensor are set to NAN
+ */
+int get_temps(double *temps) {
+  for (int i = 0; i < NUM_DISPLAY_SENSORS; i++) {
+    if (display_sensors[i] == NULL) {
+      // not that many sensors
+      temps[i] = NAN;
+      continue;
+    }
+
+    const int bytes_read = proc_reader_read(&display_sensors[i]->reader);
+
+    if (bytes_read < 0) {
+      return -SENSORS_ERR_KERNEL;
+    }
+
+    if (bytes_read == 0 || bytes_read == PROC_SMALL_BUFFER - 1) {
+      printf("Error reading sensor values!\n");
+      return -1;
+    }
+
+    const long value = strtol(display_sensors[i]->reader.buf, NULL, 10);
+
+    temps[i] = (double)value / get_type_scaling(SENSORS_SUBFEATURE_TEMP_INPUT);
+  }
+
+  return 0;
+}
+
+/*
+ * Get current memory usage values from /proc/meminfo
+ */
+struct meminfo {
+  long unsigned int mem_total;
+  long unsigned int mem_free;
+  long unsigned int mem_available;
+  long unsigned int mem_buffers;
+  long unsigned int mem_cached;
+};
+
+#define MEMINFO_TOTAL 0x01
+#define MEMINFO_FREE 0x02
+#define MEMINFO_AVAILABLE 0x04
+#define MEMINFO_BUFFERS 0x08
+#define MEMINFO_CACHED 0x10
+#define MEMINFO_ALL 0x1F
+
+// what we work usage out from without MemAvailable
+#define MEMINFO_OLD_KERNEL (MEMINFO_FREE | MEMINFO_BUFFERS | MEMINFO_CACHED)
+
+struct meminfo_key {
+  const char *name;
+  int length;
+  int flag;
+  long unsigned int meminfo::*field;
+};
+
+const meminfo_key meminfo_keys[] = {
+  { "MemTotal",     8,  MEMINFO_TOTAL,     &meminfo::mem_total },
+  { "MemFree",      7,  MEMINFO_FREE,      &meminfo::mem_free },
+  { "MemAvailable", 12, MEMINFO_AVAILABLE, &meminfo::mem_available },
+  { "Buffers",      7,  MEMINFO_BUFFERS,   &meminfo::mem_buffers },
+  { "Cached",       6,  MEMINFO_CACHED,    &meminfo::mem_cached },
+};
+
+/*
+ * Pick the fields we want out of /proc/meminfo by name, in whatever order
+ * they come. Returns the MEMINFO_* flags of the fields which were found
+ */
+int parse_meminfo(const char *buf, meminfo *result) {
+  int found = 0;
+
+  for (const char *line = buf; *line != '\0' && found != MEMINFO_ALL; line = next_line(line)) {
+    const char *p = line;
+
+    while (*p != ':' && *p != '\n' && *p != '\0') {
+      p++;
+    }
+
+    if (*p != ':') {
+      continue;
+    }
+
+    const int key_length = p - line;
+    p++;
+
+    for (const meminfo_key &key : meminfo_keys) {
+      if (key.length == key_length && !(found & key.flag) && memcmp(line, key.name, key_length) == 0) {
+        if (scan_ulong(&p, &(result->*key.field))) {
+          found |= key.flag;
+        }
+        break;
+      }
+    }
+  }
+
+  return found;
+}
+
+proc_reader meminfo_reader = PROC_READER("/proc/meminfo", PROC_MEMINFO_BUFFER);
+
+/*
+ * Get the current memory usage of the machine
+ */
+int get_mem_usage(double *fraction) {
+  meminfo mem_usage = {};
+
+  if (proc_reader_read(&meminfo_reader) < 0) {
+    printf("Error reading from /proc/meminfo!\n");
+    return -1;
+  }
+
+  const int found = parse_meminfo(meminfo_reader.buf, &mem_usage);
+
+  if (!(found & MEMINFO_TOTAL) || mem_usage.mem_total == 0) {
+    return -1;
+  }
+
+  long unsigned int mem_used;
+
+  if (found & MEMINFO_AVAILABLE) {
+    // the kernel's own estimate, which knows which caches can be dropped
+    mem_used = mem_usage.mem_total - mem_usage.mem_available;
+  }
+  else if ((found & MEMINFO_OLD_KERNEL) == MEMINFO_OLD_KERNEL) {
+    // kernels before 3.14
+    mem_used = mem_usage.mem_total - (
+      mem_usage.mem_free + mem_usage.mem_buffers + mem_usage.mem_cached
+    );
+  }
+  else {
+    return -1;
+  }
+
+  *fraction = (double)mem_used / (double)mem_usage.mem_total;
+
+  return 0;
+}
+
+/*
+ * Get current CPU time values from /proc/stat
+ */
+struct cpu_time {
+  long unsigned int time_total;
+  long unsigned int time_user;
+  long unsigned int time_nice;
+  long unsigned int time_system;
+  long unsigned int time_idle;
+  long unsigned int time_iowait;
+  long unsigned int time_irq;
+  long unsigned int time_softirq;
+};
+
+proc_reader stat_reader = PROC_READER("/proc/stat", PROC_STAT_BUFFER);
+
+int get_cpu_time(cpu_time* result) {
+  if (proc_reader_read(&stat_reader) < 0) {
+    printf("Error reading from /proc/stat!\n");
+    return -1;
+  }
+
+  long unsigned int times[10] = {};
+  
+  // the first line is the total over all CPUs; older kernels have fewer fields
+  if (strncmp(stat_reader.buf, "cpu ", 4) != 0 ||
+      scan_stat_fields(stat_reader.buf, times, 10) < 4) {
+    return -1;
+  }
+
+  result->time_user = times[0];
+  result->time_nice = times[1];
+  result->time_system = times[2];
+  result->time_idle = times[3];
+  result->time_iowait = times[4];
+  result->time_irq = times[5];
+  result->time_softirq = times[6];
+  
+  result->time_total =
+    result->time_user +
+    result->time_nice +
+    result->time_system +
+    result->time_iowait +
+    result->time_idle
+  ;
+
+  return 0;
+}
+
+/*
+ * Works out CPU usage from the difference between consecutive readings of
+ * /proc/stat, so that taking a sample is one read and never waits
+ */
+struct cpu_sampler {
+  cpu_time last;
+  bool valid;
+};
+
+/*
+ * Get the CPU usage of the machine since the last sample.
+ * Returns 1 if there isn't a usage figure yet, because this is the first
+ * sample or no time has passed since the last one
+ */
+int sample_cpu_usage(cpu_sampler *sampler, double *fraction) {
+  cpu_time current;
+
+  if (get_cpu_time(&current) == -1) {
+    return -1;
+  }
+
+  if (!sampler->valid) {
+    sampler->last = current;
+    sampler->valid = true;
+    return 1;
+  }
+
+  const long unsigned int diff_idle   = current.time_idle  - sampler->last.time_idle;
+  const long unsigned int diff_total  = current.time_total - sampler->last.time_total;
+
+  if (diff_total == 0) {
+    // keep the old reading, so that the ticks add up until there are some
+    return 1;
+  }
+
+  sampler->last = current;
+
+  *fraction = ((double)(diff_total - diff_idle) / (double)diff_total);
+
+  return 0;
+}
+
+/*
+ * Per-core counters from the cpuN lines of /proc/stat, indexed by CPU
+ * number. Kept as separate arrays so that the delta step is one straight
+ * loop over each
+ */
+struct per_cpu_times {
+  int num_cpus;
+  long unsigned int busy[MAX_CPUS];
+  long unsigned int total[MAX_CPUS];
+  bool online[MAX_CPUS];    // false past num_cpus
+};
+
+/*
+ * Read every cpuN line of /proc/stat in one pass. CPUs which are offline
+ * have no line, and aren't marked online
+ */
+int parse_per_cpu_times(const char *buf, per_cpu_times *result) {
+  memset(result->online, 0, result->num_cpus * sizeof(result->online[0]));
+  result->num_cpus = 0;
+
+  // the first line is the total, which we don't need here
+  for (const char *line = next_line(buf); strncmp(line, "cpu", 3) == 0; line = next_line(line)) {
+    const char *p = line + 3;
+    long unsigned int cpu;
+    long unsigned int times[10] = {};
+
+    // if the buffer was too small, the last line is cut short, and its
+    // counters would go backwards from one read to the next
+    if (strchr(line, '\n') == NULL) {
+      break;
+    }
+
+    if (!scan_ulong(&p, &cpu) || cpu >= MAX_CPUS || scan_stat_fields(line, times, 10) < 4) {
+      continue;
+    }
+
+    // same definition of total as get_cpu_time()
+    const long unsigned int total = times[0] + times[1] + times[2] + times[3] + times[4];
+
+    result->busy[cpu] = total - times[3];
+    result->total[cpu] = total;
+    result->online[cpu] = true;
+
+    if ((int)cpu >= result->num_cpus) {
+      result->num_cpus = cpu + 1;
+    }
+  }
+
+  return result->num_cpus > 0 ? 0 : -1;
+}
+
+/*
+ * Like cpu_sampler, for each core. The two sets of counters swap roles on
+ * every sample, so nothing is copied or allocated. This runs on the main
+ * thread, so it has its own reader for /proc/stat
+ */
+struct per_cpu_sampler {
+  per_cpu_times times[2];
+  int current;
+  bool valid;
+
+  int num_cpus;
+  float usage[MAX_CPUS];
+};
+
+proc_reader per_cpu_stat_reader = PROC_READER("/proc/stat", PROC_STAT_BUFFER);
+
+/*
+ * Update sampler->usage with each core's usage since the last sample.
+ * Returns 1 if this is the first sample, so there is no usage yet
+ */
+int sample_per_cpu_usage(per_cpu_sampler *sampler) {
+  if (proc_reader_read(&per_cpu_stat_reader) < 0) {
+    printf("Error reading from /proc/stat!\n");
+    return -1;
+  }
+
+  const int next = 1 - sampler->current;
+  per_cpu_times *last = &sampler->times[sampler->current];
+  per_cpu_times *current = &sampler->times[next];
+
+  if (parse_per_cpu_times(per_cpu_stat_reader.buf, current) != 0) {
+    return -1;
+  }
+
+  sampler->current = next;
+
+  if (!sampler->valid) {
+    sampler->valid = true;
+    return 1;
+  }
+
+  const int num_cpus = min(current->num_cpus, last->num_cpus);
+
+  for (int i = 0; i < num_cpus; i++) {
+    // either reading would be stale, so it has nothing to say
+    if (!current->online[i] || !last->online[i]) {
+      sampler->usage[i] = 0;
+      continue;
+    }
+
+    const long unsigned int diff_busy = current->busy[i] - last->busy[i];
+    const long unsigned int diff_total = current->total[i] - last->total[i];
+
+    sampler->usage[i] = diff_total > 0 ? (float)diff_busy / (float)diff_total : 0;
+  }
+
+  sampler->num_cpus = num_cpus;
+
+  return 0;
+}
+
+/*
+ * Get the number of seconds since INSTALLATION_TIME
+ */
+void get_time_seconds(double *seconds) {
+  double current_time = (double)time(NULL);
+
+  *seconds = current_time - INSTALLATION_TIME;
+}
+
+proc_reader uptime_reader = PROC_READER("/proc/uptime", PROC_SMALL_BUFFER);
+
+/*
+ * Get the number of seconds the machine has been on without
+ * a reboot
+ */
+int get_uptime_seconds(double *seconds) {
+  const char *error_text = "** Error reading from uptime file!";
+
+  const int bytes_read = proc_reader_read(&uptime_reader);
+
+  if (bytes_read <= 0 || bytes_read == PROC_SMALL_BUFFER - 1) {
+    printf("%s\n", error_text);
+    return -1;
+  }
+
+  char *buf = uptime_reader.buf;
+
+  char *uptime = strtok(buf, " ");
+
+  *seconds = atof(uptime);
+
+  return 0;
+}
+
+/*
+ * Calculate which LEDs should be on or off, so as to
+ * represent the uptime in seconds, as a binary number,
+ * where an LED being on represents "1", and off "0".
+ *
+ * E.g. an uptime of 186 seconds would be represented by the binary
+ * number 0b10111010.
+ */
+led_frame seconds_pattern(long seconds) {
+  // the last LED is the lowest bit
+  const led_frame digits = { (led_frame::word)(seconds & led_frame::ALL) };
+
+  return digits.reversed();
+}
+
+/**
+ * The number of days shown on the LED display for a number of seconds,
+ * with as many decimal places as fit in 4 digits
+ */
+int days_digits(double seconds, int *precision_out) {
+  // max 9999 days = 27 years
+  double days_raw = fmin(seconds / 86400, 9999);
+  
+  int days = floor(days_raw);
+
+  // decimal point precision
+  int precision = 0;
+
+  if (days < 10) {
+    precision = 3;
+  }
+  else if (days < 100) {
+    precision = 2;
+  }
+  else if (days < 1000) {
+    precision = 1;
+  }
+
+  int last_digits = round((days_raw - days) * pow(10, precision));
+
+  *precision_out = precision;
+
+  return days * pow(10, precision) + last_digits;
+}
+
+void format_days(int days, int precision, char *pattern) {
+  int u1 = days % 10;
+  int u2 = (int)floor(days / 10) % 10;
+  int u3 = (int)floor(days / 100) % 10;
+  int u4 = (int)floor(days / 1000) % 10;
+
+  int dp1 = precision == 1;
+  int dp2 = precision == 2;
+  int dp3 = precision == 3;
+
+  sprintf(pattern, "%d%d%d%d00%d%d0%d", dp3, u4, dp2, u3, dp1, u2, u1);
+}
+
+/**
+ * sets the correct number on the LED display, given a number of seconds
+ */
+void seconds_to_days(double seconds, char *pattern) {
+  int precision;
+  const int days = days_digits(seconds, &precision);
+
+  format_days(days, precision, pattern);
+}
+
+/* Background metrics sampling */
+
+#define SAMPLE_RING_SIZE 256    // must be a power of two
+#define MAX_SAMPLE_VALUES NUM_DISPLAY_SENSORS
+
+/*
+ * One reading of a metric, e.g. CPU usage as a fraction, or one
+ * temperature per displayed sensor
+ */
+struct metric_sample {
+  long long time;           // CLOCK_MONOTONIC, in us
+  double values[MAX_SAMPLE_VALUES];
+};
+
+/*
+ * The last SAMPLE_RING_SIZE samples of a metric, written by the sampler
+ * thread and read by any number of tasks, without either side waiting.
+ *
+ * Each slot has a sequence number which is odd while the sample in it is
+ * being written, and 2 * (n + 1) once it holds sample n. A reader checks
+ * the number before and after copying a sample out, so it can tell if the
+ * sampler overwrote it in the meantime
+ */
+struct sample_ring {
+  struct slot {
+    std::atomic<long> seq;
+    metric_sample sample;
+  };
+
+  slot slots[SAMPLE_RING_SIZE];
+  std::atomic<long> count;  // number of samples ever published
+};
+
+void sample_ring_publish(sample_ring *ring, const metric_sample *sample) {
+  const long n = ring->count.load(std::memory_order_relaxed);
+  sample_ring::slot *slot = &ring->slots[n & (SAMPLE_RING_SIZE - 1)];
+
+  slot->seq.store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot->sample = *sample;
+
+  slot->seq.store(2 * n + 2, std::memory_order_release);
+  ring->count.store(n + 1, std::memory_order_release);
+}
+
+/*
+ * Copy out sample n. Fails if it has been, or is being, overwritten
+ */
+bool sample_ring_read(sample_ring *ring, long n, metric_sample *sample) {
+  sample_ring::slot *slot = &ring->slots[n & (SAMPLE_RING_SIZE - 1)];
+
+  if (slot->seq.load(std::memory_order_acquire) != 2 * n + 2) {
+    return false;
+  }
+
+  *sample = slot->sample;
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  return slot->seq.load(std::memory_order_relaxed) == 2 * n + 2;
+}
+
+/*
+ * Get the newest sample. Returns false if there are none yet
+ */
+bool sample_ring_latest(sample_ring *ring, metric_sample *sample) {
+  while (true) {
+    const long count = ring->count.load(std::memory_order_acquire);
+
+    if (count == 0) {
+      return false;
+    }
+
+    // can only fail if the sampler went all the way round the ring
+    if (sample_ring_read(ring, count - 1, sample)) {
+      return true;
+    }
+  }
+}
+
+/*
+ * Copy the samples taken after a time into samples, newest first, up to
+ * max_samples of them. Returns how many there were
+ */
+int sample_ring_since(sample_ring *ring, long long since, metric_sample *samples, int max_samples) {
+  const long count = ring->count.load(std::memory_order_acquire);
+  const long oldest = max(count - min(max_samples, SAMPLE_RING_SIZE), 0L);
+
+  int num_samples = 0;
+
+  for (long n = count - 1; n >= oldest; n--) {
+    if (!sample_ring_read(ring, n, &samples[num_samples]) || samples[num_samples].time <= since) {
+      break;
+    }
+
+    num_samples++;
+  }
+
+  return num_samples;
+}
+
+cpu_sampler metrics_cpu_sampler = {};
+
+// returns 1 when there is nothing to publish
+int get_cpu_usage(double *fraction) {
+  return sample_cpu_usage(&metrics_cpu_sampler, fraction);
+}
+
+typedef int (*MetricReader)(double *values);
+
+/*
+ * A metric which the sampler thread reads at its own interval, for any
+ * task which displays it
+ */
+struct metric_source {
+  const char *name;
+  MetricReader read;
+  long long interval;
+  bool enabled;             // only if a task needs it
+
+  loop_timer timer;
+  timer_stats stats;
+  sample_ring ring;
+};
+
+typedef enum Metrics {
+  METRIC_CPU,
+  METRIC_MEM,
+  METRIC_TEMPS,
+  METRIC_UPTIME,
+  NUM_METRICS
+} Metric;
+
+metric_source metrics[NUM_METRICS] = {
+  { "cpu", get_cpu_usage, CPU_USAGE_SAMPLE_TIME, false, {}, {}, {} },
+  { "mem", get_mem_usage, MEM_INTERVAL, false, {}, {}, {} },
+  { "temps", get_temps, TEMPS_SAMPLE_TIME, false, {}, {}, {} },
+  { "uptime", get_uptime_seconds, UPTIME_SAMPLE_TIME, false, {}, {}, {} },
+};
+
+/*
+ * Handles --sample-<metric>=<ms>
+ */
+int set_sample_interval(const char *option) {
+  const char *value = strchr(option, '=');
+
+  for (int i = 0; value != NULL && i < NUM_METRICS; i++) {
+    if (!strncmp(option, metrics[i].name, value - option) && metrics[i].name[value - option] == '\0') {
+      const int interval = atoi(value + 1);
+
+      if (interval <= 0) {
+        printf("Invalid sample interval %s\n", value + 1);
+        return -1;
+      }
+
+      metrics[i].interval = interval * 1000LL;
+      return 0;
+    }
+  }
+
+  printf("Unknown metric in --sample-%s\n", option);
+  return -1;
+}
+
+void sample_metric(void *data, long long now) {
+  metric_source *metric = (metric_source *)data;
+
+  metric_sample sample;
+  sample.time = monotonic_us();
+
+  if (metric->read(sample.values) == 0) {
+    sample_ring_publish(&metric->ring, &sample);
+  }
+}
+
+/*
+ * Reads the enabled metrics on a thread of its own, so that the sampling
+ * intervals don't depend on how long rendering or the serial port takes
+ */
+struct metrics_sampler {
+  bool started;
+  int stop_fd;
+  event_loop loop;
+  fd_watch stop_watch;
+  std::thread thread;
+};
+
+metrics_sampler sampler;
+
+void sampler_thread() {
+  event_loop_run(&sampler.loop);
+}
+
+int start_sampler() {
+  const long long start = monotonic_us();
+  bool any_enabled = false;
+
+  if (event_loop_init(&sampler.loop) != 0) {
+    return -1;
+  }
+
+  sampler.stop_fd = eventfd(0, EFD_CLOEXEC);
+  sampler.stop_watch = { sampler.stop_fd, stop_event_loop, &sampler.loop };
+
+  if (sampler.stop_fd < 0 || event_loop_watch(&sampler.loop, &sampler.stop_watch) != 0) {
+    printf("error %d creating eventfd\n", errno);
+    return -1;
+  }
+
+  for (int i = 0; i < NUM_METRICS; i++) {
+    metric_source *metric = &metrics[i];
+
+    if (!metric->enabled) {
+      continue;
+    }
+
+    // take the first sample now, so that the tasks have one to start with
+    sample_metric(metric, start);
+
+    metric->timer.due = start + metric->interval;
+    metric->timer.interval = metric->interval;
+    metric->timer.ticks = 0;
+    metric->timer.callback = sample_metric;
+    metric->timer.data = metric;
+    metric->timer.stats = &metric->stats;
+
+    event_loop_add_timer(&sampler.loop, &metric->timer);
+    any_enabled = true;
+  }
+
+  if (any_enabled) {
+    sampler.thread = std::thread(sampler_thread);
+    sampler.started = true;
+  }
+
+  return 0;
+}
+
+void stop_sampler() {
+  if (!sampler.started) {
+    return;
+  }
+
+  const uint64_t one = 1;
+  write(sampler.stop_fd, &one, sizeof(one));
+
+  sampler.thread.join();
+}
+
+// eventfd which wakes up the main event loop on SIGINT/SIGTERM, so that
+// we can log stats before exiting
+int stop_fd = -1;
+
+void stop_running(int signum) {
+  const uint64_t one = 1;
+
+  running = 0;
+
+  if (stop_fd >= 0) {
+    write(stop_fd, &one, sizeof(one));
+  }
+}
+
+/** Pattern generating functions */
+/*
+ * The scroll text packed into bits, character i being bit i, so that any
+ * window of it can be cut out with a couple of shifts
+ */
+struct packed_text {
+  const char *text;
+  int size;
+  std::vector<uint64_t> words;
+};
+
+void pack_text(packed_text *packed, const char *text) {
+  packed->text = text;
+  packed->size = strlen(text);
+  packed->words.assign(packed->size / 64 + 1, 0);
+
+  for (int i = 0; i < packed->size; i++) {
+    if (text[i] == '1') {
+      packed->words[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+  }
+}
+
+/*
+ * Bits start to start + 63 of the text, with zeroes before and after it
+ */
+uint64_t packed_text_window(const packed_text *packed, int start) {
+  if (start <= -64 || start >= packed->size) {
+    return 0;
+  }
+
+  if (start < 0) {
+    return packed_text_window(packed, 0) << -start;
+  }
+
+  const int word = start / 64;
+  const int shift = start % 64;
+
+  uint64_t window = packed->words[word] >> shift;
+
+  if (shift > 0 && word + 1 < (int)packed->words.size()) {
+    window |= packed->words[word + 1] << (64 - shift);
+  }
+
+  return window;
+}
+
+/*
+ * Every frame of the scrolling text, worked out once so that each tick is
+ * just a lookup. For long text, the table only holds SCROLL_TABLE_SIZE
+ * frames at a time, and the next lot are worked out when we get to them
+ */
+struct scroll_table {
+  packed_text text;
+  int width;                // how many LEDs it scrolls across
+  int period;               // number of frames before it repeats
+  int first;                // the frame in frames[0]
+  int num_frames;
+  led_frame frames[SCROLL_TABLE_SIZE];
+};
+
+/*
+ * Frame n of the text scrolling past the first width LEDs
+ */
+led_frame scroll_frame(const packed_text *text, int width, int n) {
+  led_frame frame;
+
+  if (text->size <= width) {
+    // we can fit the entire string on the board, so it goes round and round
+    frame.bits = (led_frame::word)text->words[0];
+    frame = (frame.shifted(n % width) | frame.shifted(n % width - width)) & led_frame::bar(width);
+  }
+  else {
+    // the string comes in from the first LED, and goes off past the last
+    frame.bits = (led_frame::word)(packed_text_window(text, n - width) & led_frame::bar(width).bits);
+  }
+
+  return frame;
+}
+
+void fill_scroll_table(scroll_table *table, int first) {
+  table->first = first;
+  table->num_frames = min(SCROLL_TABLE_SIZE, table->period - first);
+
+  for (int i = 0; i < table->num_frames; i++) {
+    table->frames[i] = scroll_frame(&table->text, table->width, first + i);
+  }
+}
+
+void build_scroll_table(scroll_table *table, const char *text, int width) {
+  pack_text(&table->text, text);
+
+  table->width = width;
+  table->period = table->text.size <= width ? width : table->text.size + width;
+
+  fill_scroll_table(table, 0);
+}
+
+/*
+ * A frame for each place the ball can be in
+ */
+struct pong_table {
+  int period;
+  led_frame frames[PONG_PERIOD];
+};
+
+constexpr pong_table make_pong_table(int width) {
+  pong_table table = {};
+
+  table.period = max((width - 1) * 2, 1);
+
+  for (int i = 0; i < table.period; i++) {
+    // going backwards for the second half
+    table.frames[i] = led_frame::led(i < width ? i : table.period - i);
+  }
+
+  return table;
+}
+
+constexpr pong_table pong_frames = make_pong_table(NUM_LEDS);
+
+// blend modes, for how a task's layer goes on top of the ones below it
+#define BLEND_OVER 0    // replaces them, within its region
+#define BLEND_OR 1
+#define BLEND_XOR 2
+#define BLEND_MASK 3    // only lets them through where it is lit
+
+const char *blend_names[] = { "over", "or", "xor", "mask" };
+
+/*
+ * One of the inputs a task last drew from, so that it can tell when there
+ * is nothing new to draw, and skip the work
+ */
+template <typename T>
+struct memo {
+  T last;
+  bool valid;
+
+  // whether value is different from last time, remembering it if so
+  bool changed(const T &value) {
+    if (valid && value == last) {
+      return false;
+    }
+
+    last = value;
+    valid = true;
+
+    return true;
+  }
+};
+
+struct task;
+
+/*
+ * Merges the layers of all the tasks drawing on one device's LEDs into
+ * the frame which is sent to it
+ */
+struct compositor {
+  int fd;
+  bool dirty;               // something was drawn since the last frame
+  bool emitted;
+  led_frame last;
+  std::vector<task *> layers;   // bottom first
+};
+
+/*
+ * Something shown on the LEDs or the display, redrawn every interval.
+ * Each kind of task works out what it needs from its arguments once, when
+ * it is created, and keeps whatever it needs from one tick to the next
+ */
+struct task {
+  const char *name;
+  int fd;
+  long long interval;       // 0 to run once, and then exit
+
+  loop_timer timer;
+  timer_stats stats;
+
+  // LED tasks draw into a layer of their own, which is width LEDs wide,
+  // and starts at LED first
+  compositor *output;
+  led_frame layer;
+  bool drawn;
+  int first;
+  int width;
+  int blend;
+
+  // what was last put on the display
+  display_frame shown;
+  bool has_shown;
+
+  virtual ~task() {}
+
+  void draw(led_frame frame) {
+    if (drawn && frame == layer) {
+      return;
+    }
+
+    layer = frame;
+    drawn = true;
+    output->dirty = true;
+  }
+
+  void show(const char *pattern) {
+    if (has_shown && !memcmp(shown.pattern, pattern, sizeof(shown.pattern))) {
+      return;
+    }
+
+    memcpy(shown.pattern, pattern, sizeof(shown.pattern));
+    has_shown = true;
+
+    set_display(fd, pattern);
+  }
+
+  // n is the number of intervals since the first tick, which jumps ahead
+  // if ticks had to be skipped
+  virtual void tick(long long now, long long n) = 0;
+};
+
+/*
+ * What a task is created from
+ */
+struct task_config {
+  char **args;              // the arguments after the task's name
+  int width;                // the number of LEDs in its layer
+  bool display_free;        // no display task was given
+};
+
+/**
+ * output the CPU temperature to the LED display
+ */
+struct temps_task : task {
+  memo<long long> sample_time;
+
+  static task *create(const task_config *config) {
+    if (init_sensors() != 0) {
+      return NULL;
+    }
+
+    metrics[METRIC_TEMPS].enabled = true;
+
+    return new temps_task();
+  }
+
+  void tick(long long now, long long n) {
+    metric_sample sample;
+
+    if (!sample_ring_latest(&metrics[METRIC_TEMPS].ring, &sample) || !sample_time.changed(sample.time)) {
+      return;
+    }
+
+    // e.g. if CPU0 is 35C, CPU1 30C, then this shows 35:30. The protocol
+    // has no blank digit, so a sensor which is missing shows 00
+    char temps[11] = "0000000000";
+
+    for (int i = 0, o = 0; i < NUM_DISPLAY_SENSORS; i++) {
+      if (!isnan(sample.values[i])) {
+        int value = (int)sample.values[i];
+
+        // this shouldn't be necessary, unless
+        // (a) someone put liquid nitrogen on the motherboard, or
+        // (b) the sensor is calibrated incorrectly
+        value = abs(value);
+
+        if (value > 99) {
+          // hopefully this would never happen!!!
+          value = 99;
+        }
+
+        int unit  = value % 10;
+        int ten   = floor(value / 10);
+
+        char tmp_string[5];
+        sprintf(tmp_string, "0%d0%d", ten, unit);
+
+        stradd(temps, tmp_string, o, 4);
+      }
+
+      o += 4;
+
+      if (i == 0) {
+        // add parameter to print colon
+        char colon[3] = "10";
+
+        stradd(temps, colon, o, 2);
+        o += 2;
+      }
+    }
+
+    show(temps);
+  }
+};
+
+/**
+ * output a word to the LED display
+ */
+struct word_task : task {
+  char display_string[11];
+
+  static task *create(const task_config *config) {
+    // the arduino knows these words by their first letter
+    const char *words[][2] = {
+      { "aced", "A" },
+      { "beef", "B" },
+      { "babe", "C" },
+      { "dead", "D" },
+      { "deaf", "F" },
+    };
+
+    for (unsigned i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+      if (!strcmp(config->args[0], words[i][0])) {
+        word_task *word = new word_task();
+
+        sprintf(word->display_string, "%s000000000", words[i][1]);
+
+        return word;
+      }
+    }
+
+    printf("Need to give a valid word!\n");
+
+    return NULL;
+  }
+
+  void tick(long long now, long long n) {
+    show(display_string);
+  }
+};
+
+/*
+ * A string, e.g. 1110101011, is given as a parameter to the
+ * program, and this task makes the LEDs "scroll" that pattern
+ * as if it was text on a notice board.
+ */
+struct scrolltext_task : task {
+  scroll_table frames;
+
+  static task *create(const task_config *config) {
+    scrolltext_task *scroll = new scrolltext_task();
+
+    build_scroll_table(&scroll->frames, config->args[0], config->width);
+
+    return scroll;
+  }
+
+  void tick(long long now, long long n) {
+    const int frame = n % frames.period;
+
+    if (frame < frames.first || frame >= frames.first + frames.num_frames) {
+      fill_scroll_table(&frames, frame - frame % SCROLL_TABLE_SIZE);
+    }
+
+    draw(frames.frames[frame - frames.first]);
+  }
+};
+
+/*
+ * Ping-pong ball effect
+ */
+struct pong_task : task {
+  const pong_table *frames;
+  pong_table narrow_frames; // for less than the whole bar
+
+  static task *create(const task_config *config) {
+    pong_task *pong = new pong_task();
+
+    if (config->width == NUM_LEDS) {
+      pong->frames = &pong_frames;
+    }
+    else {
+      pong->narrow_frames = make_pong_table(config->width);
+      pong->frames = &pong->narrow_frames;
+    }
+
+    return pong;
+  }
+
+  void tick(long long now, long long n) {
+    const int speed_factor = 2;
+
+    draw(frames->frames[(n * speed_factor) % frames->period]);
+  }
+};
+
+/**
+ * makes the LEDs display the system uptime or time since installation,
+ * and the number of days on the display if nothing else is using it
+ */
+struct time_task : task {
+  int mode;
+  bool display;
+
+  memo<long> seconds_drawn;
+  memo<std::pair<int, int>> days_shown;  // digits and precision
+
+  static task *create(const task_config *config, int mode) {
+    time_task *time = new time_task();
+
+    time->mode = mode;
+    time->display = config->display_free;
+
+    if (mode == TIME_MODE_UPTIME) {
+      metrics[METRIC_UPTIME].enabled = true;
+    }
+
+    return time;
+  }
+
+  static task *create_uptime(const task_config *config) {
+    return create(config, TIME_MODE_UPTIME);
+  }
+
+  static task *create_alltime(const task_config *config) {
+    return create(config, TIME_MODE_ALLTIME);
+  }
+
+  void tick(long long now, long long n) {
+    double seconds;
+    long seconds_int;
+
+    metric_sample sample;
+
+    switch (mode) {
+    case TIME_MODE_ALLTIME:
+      get_time_seconds(&seconds);
+      break;
+    case TIME_MODE_UPTIME:
+    default:
+      if (!sample_ring_latest(&metrics[METRIC_UPTIME].ring, &sample)) {
+        return;
+      }
+
+      // uptime goes up with the clock, so count on from the last sample
+      seconds = sample.values[0] + (double)(now - sample.time) / 1000000;
+    }
+
+    seconds_int = (int)(seconds);
+
+    if (seconds_drawn.changed(seconds_int)) {
+      // the lowest bit goes on the last LED of the layer
+      draw(seconds_pattern(seconds_int).shifted(width - NUM_LEDS));
+    }
+
+    if (display) {
+      // display the uptime on the LED display, once it has changed
+      int precision;
+      const int days = days_digits(seconds, &precision);
+
+      if (days_shown.changed(std::make_pair(days, precision))) {
+        char pattern[11];
+        format_days(days, precision, pattern);
+
+        show(pattern);
+      }
+    }
+  }
+};
+
+/**
+ * makes the LEDs display CPU usage, averaged over the samples taken since
+ * the last time
+ */
+struct cpu_monitor_task : task {
+  long long last_sample;
+
+  static task *create(const task_config *config) {
+    metrics[METRIC_CPU].enabled = true;
+
+    return new cpu_monitor_task();
+  }
+
+  void tick(long long now, long long n) {
+    metric_sample samples[SAMPLE_RING_SIZE];
+
+    const int num_samples = sample_ring_since(
+      &metrics[METRIC_CPU].ring, last_sample, samples, SAMPLE_RING_SIZE
+    );
+
+    if (num_samples == 0) {
+      return;
+    }
+
+    double cpu_usage = 0;
+
+    for (int i = 0; i < num_samples; i++) {
+      cpu_usage += samples[i].values[0];
+    }
+
+    cpu_usage /= num_samples;
+    last_sample = samples[0].time;
+
+    draw(led_frame::bar((int)round(cpu_usage * width)));
+  }
+};
+
+/**
+ * makes the LEDs show how busy each core is. With more cores than LEDs,
+ * each LED shows the average of its bin of cores, and with fewer, each core
+ * spans several LEDs. Usage between 0 and 1 is shown by switching the LED
+ * on for that fraction of frames, using error diffusion over time
+ */
+struct cpu_heatmap_task : task {
+  per_cpu_sampler sampler;
+  long long sampled_at;
+  float error[NUM_LEDS];
+
+  static task *create(const task_config *config) {
+    return new cpu_heatmap_task();
+  }
+
+  void tick(long long now, long long n) {
+    // by time rather than by n, which jumps over ticks that were skipped
+    if (now - sampled_at >= CPU_USAGE_SAMPLE_TIME) {
+      sample_per_cpu_usage(&sampler);
+      sampled_at = now;
+    }
+
+    const int num_cpus = sampler.num_cpus;
+
+    if (num_cpus == 0) {
+      return;
+    }
+
+    led_frame leds = {};
+
+    for (int i = 0; i < width; i++) {
+      const int first = i * num_cpus / width;
+      const int last = max(first + 1, (i + 1) * num_cpus / width);
+
+      float intensity = 0;
+
+      for (int cpu = first; cpu < last; cpu++) {
+        intensity += sampler.usage[cpu];
+      }
+
+      error[i] += intensity / (last - first);
+
+      if (error[i] >= 0.5) {
+        leds = leds | led_frame::led(i);
+        error[i] -= 1;
+      }
+    }
+
+    draw(leds);
+  }
+};
+
+/**
+ * makes the LEDs display memory usage
+ */
+struct mem_monitor_task : task {
+  memo<long long> sample_time;
+
+  static task *create(const task_config *config) {
+    metrics[METRIC_MEM].enabled = true;
+
+    return new mem_monitor_task();
+  }
+
+  void tick(long long now, long long n) {
+    metric_sample sample;
+
+    if (!sample_ring_latest(&metrics[METRIC_MEM].ring, &sample) || !sample_time.changed(sample.time)) {
+      return;
+    }
+
+    const double mem_usage = sample.values[0];
+
+    draw(led_frame::bar((int)round(mem_usage * width)));
+  }
+};
+
+/**
+ * turns all the LEDs off
+ * TODO: make this turn the LED display off
+ */
+struct quiet_task : task {
+  static task *create(const task_config *config) {
+    return new quiet_task();
+  }
+
+  void tick(long long now, long long n) {
+    draw(led_frame{});
+
+    char quiet_display[11];
+    
+    memset(quiet_display, '0', 10);
+    memset(quiet_display, 'Q', 1);
+
+    quiet_display[10] = '\0';
+
+    show(quiet_display);
+  }
+};
+
+/*
+ * Every kind of task, by the name it is given on the command line
+ */
+struct task_type {
+  const char *name;
+  int num_args;
+  const char *missing_args; // what to say if they weren't given
+  long long interval;
+  bool display;             // uses the display rather than the LEDs
+  task *(*create)(const task_config *config);
+};
+
+const task_type task_types[] = {
+  { "temps", 0, NULL, DEFAULT_INTERVAL, true, temps_task::create },
+  { "word", 1, "Need to give a word!", DEFAULT_INTERVAL, true, word_task::create },
+  { "scrolltext", 1, "You need to supply some text to scroll with!", SCROLL_INTERVAL, false, scrolltext_task::create },
+  { "pong", 0, NULL, PONG_INTERVAL, false, pong_task::create },
+  { "uptime", 0, NULL, DEFAULT_INTERVAL, false, time_task::create_uptime },
+  { "alltime", 0, NULL, DEFAULT_INTERVAL, false, time_task::create_alltime },
+  { "cpu", 0, NULL, CPU_USAGE_SAMPLE_TIME, false, cpu_monitor_task::create },
+  { "mem", 0, NULL, MEM_INTERVAL, false, mem_monitor_task::create },
+  { "quiet", 0, NULL, 0, false, quiet_task::create },
+  { "cores", 0, NULL, HEATMAP_INTERVAL, false, cpu_heatmap_task::create },
+};
+
+#define NUM_TASK_TYPES (int)(sizeof(task_types) / sizeof(task_types[0]))
+
+const task_type *find_task_type(const char *name) {
+  for (int i = 0; i < NUM_TASK_TYPES; i++) {
+    if (!strcmp(task_types[i].name, name)) {
+      return &task_types[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * A task as given on the command line, e.g. "cpu@0-14:or", which is the
+ * cpu task, drawing on LEDs 0 to 14, ORed with the tasks before it
+ */
+struct task_spec {
+  const task_type *type;
+  char **args;
+  int first;
+  int last;
+  int blend;
+};
+
+int parse_task_spec(char *arg, task_spec *spec) {
+  char *blend = strchr(arg, ':');
+  char *region = strchr(arg, '@');
+
+  if (blend != NULL) {
+    *blend++ = '\0';
+  }
+
+  if (region != NULL) {
+    *region++ = '\0';
+  }
+
+  spec->type = find_task_type(arg);
+
+  if (spec->type == NULL) {
+    printf("Invalid task given: %s\n", arg);
+    return -1;
+  }
+
+  if ((region != NULL || blend != NULL) && spec->type->display) {
+    printf("%s uses the display, so it has no LEDs to blend\n", arg);
+    return -1;
+  }
+
+  spec->first = 0;
+  spec->last = NUM_LEDS - 1;
+  spec->blend = BLEND_OVER;
+
+  if (region != NULL && (
+    sscanf(region, "%d-%d", &spec->first, &spec->last) != 2 ||
+    spec->first < 0 || spec->last >= NUM_LEDS || spec->first > spec->last
+  )) {
+    printf("Invalid LEDs for %s: %s, must be from 0 to %d\n", arg, region, NUM_LEDS - 1);
+    return -1;
+  }
+
+  if (blend != NULL) {
+    spec->blend = -1;
+
+    for (int i = 0; i < (int)(sizeof(blend_names) / sizeof(blend_names[0])); i++) {
+      if (!strcmp(blend, blend_names[i])) {
+        spec->blend = i;
+      }
+    }
+
+    if (spec->blend == -1) {
+      printf("Invalid blend mode for %s: %s\n", arg, blend);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Create the tasks named in args, each followed by its own arguments,
+ * e.g. "scrolltext 1101 temps". Tasks which draw on the LEDs are layered
+ * in output, in the order they were given
+ */
+int create_tasks(compositor *output, int num_args, char *args[], std::vector<task *> *tasks) {
+  std::vector<task_spec> specs;
+
+  task_config config;
+  config.display_free = true;
+
+  // check them all first, to find out whether anything is using the display
+  for (int i = 0; i < num_args; ) {
+    task_spec spec;
+
+    if (parse_task_spec(args[i], &spec) != 0) {
+      return -1;
+    }
+
+    if (i + spec.type->num_args >= num_args) {
+      printf("%s\n", spec.type->missing_args);
+      return -1;
+    }
+
+    if (spec.type->display) {
+      config.display_free = false;
+    }
+
+    spec.args = &args[i + 1];
+    specs.push_back(spec);
+
+    i += 1 + spec.type->num_args;
+  }
+
+  for (const task_spec &spec : specs) {
+    config.args = spec.args;
+    config.width = spec.last - spec.first + 1;
+
+    task *created = spec.type->create(&config);
+
+    if (created == NULL) {
+      return -1;
+    }
+
+    created->name = spec.type->name;
+    created->fd = output->fd;
+    created->interval = spec.type->interval;
+
+    created->output = output;
+    created->drawn = false;
+    created->has_shown = false;
+    created->first = spec.first;
+    created->width = config.width;
+    created->blend = spec.blend;
+
+    if (!spec.type->display) {
+      output->layers.push_back(created);
+    }
+
+    tasks->push_back(created);
+  }
+
+  return 0;
+}
+
+/*
+ * Once the tasks which were due have drawn, merge their layers and send the
+ * result, unless it is the same as last time
+ */
+void compositor_flush(void *data) {
+  compositor *output = (compositor *)data;
 
-  stradd(str, zeroes_before, 0, num_zeroes_before);
-  str[offset] = '1';
-  stradd(str, zeroes_after, num_zeroes_before + 1, num_zeroes_after);
+  if (!output->dirty) {
+    return;
+  }
 
-  set_pattern(fd, str);
+  output->dirty = false;
 
-  return 0;
+  led_frame frame = {};
+
+  for (const task *layer : output->layers) {
+    if (!layer->drawn) {
+      continue;
+    }
+
+    const led_frame region = led_frame::bar(layer->width).shifted(layer->first);
+    const led_frame lit = layer->layer.shifted(layer->first) & region;
+
+    switch (layer->blend) {
+    case BLEND_OVER:
+      frame = (frame & ~region) | lit;
+      break;
+    case BLEND_OR:
+      frame = frame | lit;
+      break;
+    case BLEND_XOR:
+      frame = frame ^ lit;
+      break;
+    case BLEND_MASK:
+      frame = frame & (lit | ~region);
+      break;
+    }
+  }
+
+  if (output->emitted && frame == output->last) {
+    return;
+  }
+
+  output->last = frame;
+  output->emitted = true;
+
+  set_pattern(output->fd, frame);
+}
+
+void flush_compositors(void *data) {
+  for (compositor *output : *(std::vector<compositor *> *)data) {
+    compositor_flush(output);
+  }
+}
+
+void run_task(void *data, long long now) {
+  task *scheduled = (task *)data;
+
+  scheduled->tick(now, scheduled->timer.ticks);
+}
+
+void print_timer_stats(const char *kind, const char *name, const timer_stats *stats) {
+  if (stats->runs == 0) {
+    return;
+  }
+
+  printf(
+    "%s %s: %lld runs, %lld skipped, lateness %lld/%lld/%lld/%lld us (min/avg/p99/max)\n",
+    kind,
+    name,
+    stats->runs,
+    stats->skipped,
+    stats->lateness_min,
+    stats->lateness_total / stats->runs,
+    timer_stats_percentile(stats, 99),
+    stats->lateness_max
+  );
 }
 
 /**
- * makes the LEDs display the system uptime or time since installation
+ * Runs the tasks to display something on the LEDs and display,
+ * each at its own interval, until we are told to stop. If one of them
+ * only runs once, so do all the others
  */
-int do_time(int args[3], int loop, char *seq) {
-  const int fd = args[0];
-  const int mode = args[1];
-  const bool display = args[2] > 0;
+void loop(std::vector<task *> &tasks, std::vector<compositor *> &outputs) {
+  const long long start = monotonic_us();
+
+  bool run_once = false;
 
-  double seconds;
-  long seconds_int;
+  for (task *scheduled : tasks) {
+    scheduled->timer.due = start;
+    scheduled->timer.interval = scheduled->interval;
+    scheduled->timer.ticks = 0;
+    scheduled->timer.callback = run_task;
+    scheduled->timer.data = scheduled;
+    scheduled->timer.stats = &scheduled->stats;
 
-  switch (mode) {
-  case TIME_MODE_ALLTIME:
-    get_time_seconds(&seconds);
-    break;
-  case TIME_MODE_UPTIME:
-  default:
-    get_uptime_seconds(&seconds);
+    if (scheduled->interval == 0) {
+      run_once = true;
+    }
   }
 
-  seconds_int = (int)(seconds);
+  if (run_once) {
+    for (task *scheduled : tasks) {
+      run_task(scheduled, start);
+    }
+
+    flush_compositors(&outputs);
 
-  set_seconds_pattern(fd, &seconds_int);
+    return;
+  }
 
-  if (display) {
-    // display the uptime on the LED display
-    char pattern[10];
-    seconds_to_days(seconds, pattern);
+  event_loop event_loop;
 
-    set_display(fd, pattern);
+  if (event_loop_init(&event_loop) != 0) {
+    return;
   }
 
-  return 0;
+  event_loop.idle = flush_compositors;
+  event_loop.idle_data = &outputs;
+
+  fd_watch stop_watch = { stop_fd, stop_event_loop, &event_loop };
+
+  if (stop_fd >= 0) {
+    event_loop_watch(&event_loop, &stop_watch);
+  }
+
+  for (task *scheduled : tasks) {
+    event_loop_add_timer(&event_loop, &scheduled->timer);
+  }
+
+  event_loop_run(&event_loop);
+
+  close(event_loop.timer_watch.fd);
+  close(event_loop.epoll_fd);
+
+  for (task *scheduled : tasks) {
+    print_timer_stats(writer_for_fd(scheduled->fd)->name, scheduled->name, &scheduled->stats);
+  }
 }
 
-/**
- * makes the LEDs display CPU usage
+/** Replay */
+#define REPLAY_RELEASE_BYTES (64 << 20)   // let go of the mapping behind us in steps of this
+#define REPLAY_STOP_CHECK 1024            // records between checks for SIGINT, as fast as possible
+
+/*
+ * A recording being played back from a read only mapping of the file.
+ * Pages which have been played are dropped as we go, so that even a huge
+ * recording only ever has a few MB of it in memory
  */
-int do_cpu_monitor(int args[1], int loop, char *seq) {
-  const int fd = args[0];
-  
-  double cpu_usage;
+struct replay_state {
+  const char *path;
+  const uint8_t *map;
+  size_t map_size;
+  size_t released;          // bytes at the start of the mapping we have dropped
+
+  const frame_record *records;
+  long num_records;
+  long next;
+  long frames;              // records which went to a device
+
+  long long offset;         // us, from a record's time to when it is due
+  long long started;
+
+  event_loop *loop;
+  loop_timer timer;
+  timer_stats stats;
+};
 
-  char leds[NUM_LEDS];
+int open_replay(const char *path, replay_state *replay) {
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("error %d opening %s: %s\n", errno, path, strerror(errno));
+    return -1;
+  }
 
-  while (1) {
-    // this takes about a second
-    get_cpu_usage(&cpu_usage);
+  if (st.st_size < RECORD_SIZE) {
+    printf("%s isn't a recording!\n", path);
+    close(fd);
+    return -1;
+  }
 
-    const int num_leds_lit = (int)(round(cpu_usage * NUM_LEDS));
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
 
-    memset(leds, '1', num_leds_lit);
-    
-    char zeroes[NUM_LEDS - num_leds_lit];
-    memset(zeroes, '0', NUM_LEDS - num_leds_lit);
-    stradd(leds, zeroes, num_leds_lit, NUM_LEDS - num_leds_lit);
+  if (map == MAP_FAILED) {
+    printf("error %d mapping %s\n", errno, path);
+    return -1;
+  }
 
-    set_pattern(fd, leds);
+  if (!valid_record_header((const record_header *)map)) {
+    printf("%s isn't a recording of %d LEDs we can play!\n", path, NUM_LEDS);
+    munmap(map, st.st_size);
+    return -1;
   }
 
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  replay->path = path;
+  replay->map = (const uint8_t *)map;
+  replay->map_size = st.st_size;
+  replay->released = 0;
+  replay->records = (const frame_record *)(replay->map + RECORD_SIZE);
+  replay->num_records = (st.st_size - RECORD_SIZE) / RECORD_SIZE;
+  replay->next = 0;
+  replay->frames = 0;
+
   return 0;
 }
 
-/**
- * makes the LEDs display memory usage
+void close_replay(replay_state *replay) {
+  munmap((void *)replay->map, replay->map_size);
+}
+
+/*
+ * Send the next record to its device, if there is one
  */
-int do_mem_monitor(int args[1], int loop, char *seq) {
-  const int fd = args[0];
+void replay_record(replay_state *replay, const frame_record *record) {
+  if (record->device >= num_writers) {
+    return;
+  }
 
-  double mem_usage;
+  serial_writer *writer = writers[record->device];
 
-  char leds[NUM_LEDS];
+  if (record->channel == RECORD_LEDS) {
+    uint64_t bits = 0;
 
-  get_mem_usage(&mem_usage);
+    for (int i = 0; i < 8; i++) {
+      bits |= (uint64_t)record->payload[i] << (i * 8);
+    }
+
+    set_pattern(writer->fd, { (led_frame::word)(bits & led_frame::ALL) });
+    replay->frames++;
+  }
+  else if (record->channel == RECORD_DISPLAY) {
+    set_display(writer->fd, (const char *)record->payload);
+    replay->frames++;
+  }
+}
 
-  const int num_leds_lit = (int)(round(mem_usage * NUM_LEDS));
+/*
+ * Send a record, waiting until its device has taken it. Nothing is
+ * dropped in favour of newer frames, as it would be from the tasks
+ */
+void replay_send(replay_state *replay, const frame_record *record) {
+  replay_record(replay, record);
 
-  memset(leds, '1', num_leds_lit);
-  
-  char zeroes[NUM_LEDS - num_leds_lit];
-  memset(zeroes, '0', NUM_LEDS - num_leds_lit);
-  stradd(leds, zeroes, num_leds_lit, NUM_LEDS - num_leds_lit);
+  if (record->device < num_writers) {
+    drain_writer(writers[record->device]);
+  }
+}
+
+/*
+ * Drop the pages we have played from memory
+ */
+void replay_release(replay_state *replay) {
+  const size_t played = RECORD_SIZE + replay->next * RECORD_SIZE;
+  const size_t page_size = sysconf(_SC_PAGESIZE);
 
-  set_pattern(fd, leds);
+  if (played - replay->released < REPLAY_RELEASE_BYTES) {
+    return;
+  }
 
-  return 0;
+  const size_t end = played - played % page_size;
+
+  madvise((void *)(replay->map + replay->released), end - replay->released, MADV_DONTNEED);
+  replay->released = end;
 }
 
-/**
- * turns all the LEDs off
- * TODO: make this turn the LED display off
+/*
+ * Play the records which are due, then sleep until the next one. Each
+ * RECORD_START lines the recording which follows up with now, so that
+ * the gaps between recordings which were appended to one file are skipped
  */
-int do_quiet(int args[1], int loop, char *seq) {
-  const int fd = args[0];
+void replay_tick(void *data, long long now) {
+  replay_state *replay = (replay_state *)data;
 
-  char str[NUM_LEDS + 1];
-  
-  memset(str, '0', NUM_LEDS);
-  str[NUM_LEDS] = '\0';
+  while (replay->next < replay->num_records && running) {
+    const frame_record *record = &replay->records[replay->next];
+    const long long time = record->time / 1000;
+
+    if (record->channel == RECORD_START) {
+      replay->offset = now - time;
+    }
+    else if (time + replay->offset > now) {
+      replay->timer.due = time + replay->offset;
+      event_loop_add_timer(replay->loop, &replay->timer);
+      break;
+    }
 
-  set_pattern(fd, str);
+    replay_send(replay, record);
+    replay->next++;
+  }
 
-  char quiet_display[11];
-  
-  memset(quiet_display, '0', 10);
-  memset(quiet_display, 'Q', 1);
+  replay_release(replay);
+
+  if (replay->next == replay->num_records || !running) {
+    stop_event_loop(replay->loop);
+  }
+}
+
+/*
+ * Play a recording back in real time, until it ends or we are stopped.
+ * Frames are written out in order without the I/O thread, so when a
+ * device can't keep up they go out late rather than being skipped, which
+ * shows up in the lateness stats
+ */
+void replay_realtime(replay_state *replay) {
+  event_loop event_loop;
+
+  if (event_loop_init(&event_loop) != 0) {
+    return;
+  }
+
+  fd_watch stop_watch = { stop_fd, stop_event_loop, &event_loop };
 
-  quiet_display[10] = '\0';
+  if (stop_fd >= 0) {
+    event_loop_watch(&event_loop, &stop_watch);
+  }
 
-  set_display(fd, quiet_display);
+  replay->loop = &event_loop;
+  replay->started = monotonic_us();
 
-  return 0;
+  // the first records are due now, whenever they were recorded
+  replay->offset = replay->num_records > 0 ? replay->started - replay->records[0].time / 1000 : 0;
+
+  replay->timer.due = replay->started;
+  replay->timer.interval = 0;
+  replay->timer.callback = replay_tick;
+  replay->timer.data = replay;
+  replay->timer.stats = &replay->stats;
+
+  event_loop_add_timer(&event_loop, &replay->timer);
+
+  event_loop_run(&event_loop);
+
+  close(event_loop.timer_watch.fd);
+  close(event_loop.epoll_fd);
+
+  print_timer_stats("Replay", replay->path, &replay->stats);
 }
 
-typedef int (*FunctionCallback)(int*, int, char*);
-FunctionCallback functions[] = {
-  &do_temps,
-  &do_word,
-  &do_scrolltext,
-  &do_pong,
-  &do_time,
-  &do_cpu_monitor,
-  &do_mem_monitor,
-  &do_quiet,
-};
+/*
+ * Play a recording back as fast as the devices will take it, without the
+ * I/O thread. Every frame is sent, each as soon as its device has room
+ */
+void replay_fast(replay_state *replay) {
+  replay->started = monotonic_us();
 
-typedef enum Tasks {
-  TASK_TEMPS,
-  TASK_WORD,
-  TASK_SCROLLTEXT,
-  TASK_PONG,
-  TASK_TIME,
-  TASK_CPU_MONITOR,
-  TASK_MEM_MONITOR,
-  TASK_QUIET
-} Task;
+  for (; replay->next < replay->num_records; replay->next++) {
+    replay_send(replay, &replay->records[replay->next]);
 
-/**
- * Runs one of the do_* functions to display something on the LEDs and display
+    if (replay->next % REPLAY_STOP_CHECK == 0) {
+      struct pollfd pfd = { stop_fd, POLLIN, 0 };
+
+      if (poll(&pfd, 1, 0) > 0) {
+        break;
+      }
+
+      replay_release(replay);
+    }
+  }
+}
+
+// --list-sensors: print the temperature sensors we can find, and exit
+bool show_sensor_list = false;
+
+// --config=FILE: the devices to drive, and what to show on each
+const char *config_path = NULL;
+
+// --record=FILE: append every frame sent to the devices to a recording
+const char *record_path = NULL;
+
+// --replay=FILE: play a recording to the devices instead of running tasks,
+// in real time, or as fast as they will take it with --replay-fast
+const char *replay_path = NULL;
+bool replay_as_fast_as_possible = false;
+
+/*
+ * --baud=N, which has to be one of the rates the firmware knows
  */
-void loop(
-  int tasks[],
-  int num_tasks,
-  int tasks_args[][5],
-  int tasks_num_args[],
-  int tasks_intervals[],
-  int delay,
-  char* seq, 
-  bool break_loop
-) {
-  int k = 0;
+int parse_max_baud(const char *value) {
+  char *end;
+  const long baud = strtol(value, &end, 10);
+
+  for (int i = 0; i < NUM_BAUD_RATES; i++) {
+    if (*end == '\0' && baud == baud_rates[i]) {
+      return baud;
+    }
+  }
 
-  int task_time_counters[num_tasks];
+  printf("Unsupported baud rate %s!\n", value);
 
-  for (int i = 0; i < num_tasks; i++) {
-    task_time_counters[i] = 0;
+  return -1;
+}
+
+/*
+ * Handles an option which can be different for each device. Returns 1 if
+ * it was one of those, 0 if it isn't, and -1 if its value is wrong
+ */
+int parse_device_option(const char *arg, device_options *options) {
+  if (!strcmp(arg, "--protocol=ascii")) {
+    options->protocol = PROTOCOL_ASCII;
+  } else if (!strcmp(arg, "--protocol=binary")) {
+    options->protocol = PROTOCOL_BINARY;
+  } else if (!strcmp(arg, "--protocol=delta")) {
+    options->protocol = PROTOCOL_DELTA;
+  } else if (!strcmp(arg, "--no-flow-control")) {
+    options->flow_control = false;
+  } else if (!strncmp(arg, "--baud=", 7)) {
+    options->max_baud = parse_max_baud(arg + 7);
+
+    if (options->max_baud < 0) {
+      return -1;
+    }
+  } else {
+    return 0;
   }
 
-  auto start = std::chrono::high_resolution_clock::now();
+  return 1;
+}
+
+/**
+ * Handles --option arguments, and removes them from argv so that
+ * the positional arguments (device, tasks) can be read as before
+ */
+int parse_options(int *argc, char *argv[]) {
+  int num_positional = 1;
+
+  for (int i = 1; i < *argc; i++) {
+    const char *arg = argv[i];
+
+    if (strncmp(arg, "--", 2) != 0) {
+      argv[num_positional++] = argv[i];
+      continue;
+    }
+
+    const int device_option = parse_device_option(arg, &default_options);
+
+    if (device_option < 0) {
+      return -1;
+    }
 
-  while (1) {
-    auto elapsed = std::chrono::high_resolution_clock::now() - start;
-    long long microseconds = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    if (device_option > 0) {
+      continue;
+    }
 
-    for (int i = 0; i < num_tasks; i++) {
-      int task = tasks[i];
-      
-      const int num_args = tasks_num_args[i];
-      
-      int args[num_args];
+    if (!strncmp(arg, "--sensor=", 9)) {
+      if (num_sensor_names == NUM_DISPLAY_SENSORS) {
+        printf("Can only display %d sensors!\n", NUM_DISPLAY_SENSORS);
+        return -1;
+      }
 
-      for (int j = 0; j < num_args; j++) {
-        args[j] = tasks_args[i][j];
+      sensor_names[num_sensor_names++] = arg + 9;
+    } else if (!strcmp(arg, "--list-sensors")) {
+      show_sensor_list = true;
+    } else if (!strncmp(arg, "--sample-", 9)) {
+      if (set_sample_interval(arg + 9) != 0) {
+        return -1;
       }
+    } else if (!strncmp(arg, "--config=", 9)) {
+      config_path = arg + 9;
+    } else if (!strncmp(arg, "--record=", 9)) {
+      record_path = arg + 9;
+    } else if (!strncmp(arg, "--replay=", 9)) {
+      replay_path = arg + 9;
+    } else if (!strcmp(arg, "--replay-fast")) {
+      replay_as_fast_as_possible = true;
+    } else {
+      printf("Unknown option %s\n", arg);
+      return -1;
+    }
+  }
+
+  *argc = num_positional;
+  argv[num_positional] = NULL;
+
+  return 0;
+}
+
+/*
+ * A board to drive, and what to show on it
+ */
+struct device {
+  const char *path;
+  device_options options;
+  std::vector<char *> args; // its tasks, each followed by its arguments
+
+  serial_writer *writer;
+  link_info link;
+  compositor output;
+  std::thread handshake;
+};
+
+/*
+ * Read the devices to drive from a config file. Each line is a device,
+ * then any options for it, then its tasks, as they would be given on the
+ * command line, e.g.
+ *
+ *   # device       options           tasks
+ *   /dev/ttyACM0   --protocol=delta  cpu@0-14 mem@15-29 temps
+ *   /dev/ttyACM1                     pong word beef
+ *
+ * Options on the command line apply to every device, unless its line
+ * says otherwise
+ */
+int read_config(const char *path, std::vector<device *> *devices) {
+  FILE *file = fopen(path, "r");
+
+  if (file == NULL) {
+    printf("error %d opening %s: %s\n", errno, path, strerror(errno));
+    return -1;
+  }
+
+  char line[4096];
+  int line_number = 0;
+  int result = 0;
+
+  while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+    line_number++;
 
-      int age = microseconds - task_time_counters[i];
+    char *comment = strchr(line, '#');
 
-      int diff = k == 0 ? 0 : age - tasks_intervals[i];
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+
+    device *dev = NULL;
+
+    for (char *word = strtok(line, " \t\r\n"); word != NULL; word = strtok(NULL, " \t\r\n")) {
+      // the tasks keep pointers to their arguments
+      word = strdup(word);
+
+      if (dev == NULL) {
+        dev = new device();
+        dev->path = word;
+        dev->options = default_options;
+      } else if (!strncmp(word, "--", 2)) {
+        const int device_option = parse_device_option(word, &dev->options);
 
-      if (diff >= 0) {
-        task_time_counters[i] = microseconds - diff;
+        if (device_option == 0) {
+          printf("%s:%d: Unknown option %s\n", path, line_number, word);
+        }
 
-        functions[task](args, k, seq);
+        if (device_option <= 0) {
+          result = -1;
+        }
+      } else {
+        dev->args.push_back(word);
       }
     }
 
-    if (break_loop) {
-      break;
+    if (dev == NULL) {
+      continue;
     }
-    
-    k++;
 
-    usleep(delay);
-  }
-}
+    if (dev->args.empty() && replay_path == NULL) {
+      printf("%s:%d: No task given for %s!\n", path, line_number, dev->path);
+      result = -1;
+    }
 
-int main(int argc, char *argv[]) {
-  using std::chrono::system_clock;
-  using std::chrono::milliseconds;
-  using std::chrono::duration_cast;
-  
-  /* set up serial device */
-  if (argc < 2) {
-    printf("Must provide device as first argument, e.g. /dev/ttyACM0\n");
-    return 1;
+    devices->push_back(dev);
   }
-  if (argc < 3) {
-    printf("No task given!\n");
-    return 1;
+
+  fclose(file);
+
+  if (result == 0 && devices->empty()) {
+    printf("No devices in %s!\n", path);
+    result = -1;
   }
 
-  const char *portname = argv[1];
+  return result;
+}
 
-  printf("Attempting to open dev %s...\n", portname);
-  int fd = open(portname, O_RDWR | O_NOCTTY | O_SYNC);
+int open_device(device *dev) {
+  printf("Attempting to open dev %s...\n", dev->path);
+  int fd = open(dev->path, O_RDWR | O_NOCTTY | O_SYNC);
 
   if (fd < 0) {
-    printf("error %d opening %s: %s\n", fd, portname, strerror(fd));
-    return 1;
+    printf("error %d opening %s: %s\n", errno, dev->path, strerror(errno));
+    return -1;
   }
 
   set_interface_attribs(fd, B9600, 0); // 9600 baud, no parity
   set_blocking(fd, 0);		             // set no blocking
 
-  const char *task_led = argv[2];
+  dev->writer = create_writer(dev->path, fd);
+
+  if (dev->writer == NULL) {
+    return -1;
+  }
+
+  dev->output.fd = fd;
+
+  return 0;
+}
+
+void print_writer_stats(const serial_writer *writer) {
+  printf(
+    "%s: Writer: %ld frames written (%ld resent), %ld unchanged, %ld dropped in favour of newer ones\n",
+    writer->name,
+    writer->frames_written,
+    writer->frames_resent,
+    writer->frames_unchanged,
+    writer->frames_published - (writer->frames_written - writer->frames_resent) - writer->frames_unchanged
+  );
+
+  const flow_state *flow = &writer->flow;
+
+  if (flow->enabled) {
+    const long num_replies = flow->frames_acked + flow->frames_rejected;
+
+    printf(
+      "%s: Flow control: %ld frames acknowledged, %ld rejected, %ld timeouts, latency %d/%lld/%d us (min/avg/max)\n",
+      writer->name,
+      flow->frames_acked,
+      flow->frames_rejected,
+      flow->timeouts,
+      flow->latency_min,
+      num_replies > 0 ? flow->latency_total / num_replies : 0,
+      flow->latency_max
+    );
+  }
+}
+
+#ifndef LEDSEQ_NO_MAIN
+int main(int argc, char *argv[]) {
+  if (parse_options(&argc, argv) != 0) {
+    return 1;
+  }
 
-  int task2_offset = 0;
+  if (show_sensor_list) {
+    list_sensors();
+    return 0;
+  }
 
-  bool task_alltime     = !strcmp(task_led, "alltime");
-  bool task_uptime      = !strcmp(task_led, "uptime");
-  bool task_scrolltext  = !strcmp(task_led, "scrolltext");
-  bool task_pong        = !strcmp(task_led, "pong");
-  bool task_mem_monitor = !strcmp(task_led, "mem");
-  bool task_cpu_monitor = !strcmp(task_led, "cpu");
-  bool task_quiet       = !strcmp(task_led, "quiet");
+  std::vector<device *> devices;
 
-  if (task_scrolltext) {
-    task2_offset++;
+  if (config_path != NULL) {
+    if (read_config(config_path, &devices) != 0) {
+      return 1;
+    }
   }
+  else {
+    /* set up serial device */
+    if (argc < 2) {
+      printf("Must provide device as first argument, e.g. /dev/ttyACM0, or --config=FILE\n");
+      return 1;
+    }
+    if (argc < 3 && replay_path == NULL) {
+      printf("No task given!\n");
+      return 1;
+    }
 
-  const char *task_display = argc > 3 + task2_offset ? argv[3 + task2_offset] : NULL;
+    device *dev = new device();
 
-  int num_tasks = 1;
-  if (task_display != NULL) {
-    num_tasks++;
+    dev->path = argv[1];
+    dev->options = default_options;
+    dev->args.assign(&argv[2], &argv[argc]);
+
+    devices.push_back(dev);
   }
 
-  int loop_tasks[num_tasks];
-  int loop_args[num_tasks][5];
-  int loop_num_args[num_tasks];
-  int loop_task_intervals[num_tasks];
-  int break_loop = false;
-  int loop_delay = 1000000;
+  replay_state replay = {};
 
-  for (int i = 0; i < num_tasks; i++) {
-    // the first argument for every do_* function is always fd
-    loop_args[i][0] = fd;
-    loop_task_intervals[i] = loop_delay;
+  if (replay_path != NULL && open_replay(replay_path, &replay) != 0) {
+    return 1;
   }
 
-  // for use with scrolltext and other things requiring a char
-  char *seq;
+  if (init_io() != 0) {
+    return 1;
+  }
 
-  Task task;
+  std::vector<task *> tasks;
+  std::vector<compositor *> outputs;
 
-  if (task_scrolltext) {
-    if (argc < 4) {
-      printf("You need to supply some text to scroll with!\n");
-      return 2;
+  for (device *dev : devices) {
+    if (open_device(dev) != 0) {
+      return 1;
     }
-    
-    seq = argv[3];
-    
-    task = TASK_SCROLLTEXT;
-    loop_tasks[0] = task;
-    loop_num_args[0] = 1;
-    
-    loop_task_intervals[0] = SCROLL_INTERVAL;
-    loop_delay = fmin(loop_delay, SCROLL_INTERVAL);
-  } else if (task_pong) {
-    task = TASK_PONG;
-    loop_tasks[0] = task;
-    loop_num_args[0] = 1;
-
-    loop_task_intervals[0] = PONG_INTERVAL;
-    loop_delay = fmin(loop_delay, PONG_INTERVAL);
-  } else if (task_alltime || task_uptime) {
-    task = TASK_TIME;
-
-    loop_tasks[0] = task;
-    loop_args[0][1] = task_alltime ? TIME_MODE_ALLTIME : TIME_MODE_UPTIME;
-    loop_args[0][2] = task_display == NULL ? 1 : 0;
-    loop_num_args[0] = 3;
-  } else if (task_cpu_monitor) {
-    task = TASK_CPU_MONITOR;
-    loop_tasks[0] = task;
-    loop_num_args[0] = 1;
-
-    loop_task_intervals[0] = 10; // the CPU usage monitor takes about a second for itself
-    loop_delay = fmin(loop_delay, 10);
-  } else if (task_mem_monitor) {
-    task = TASK_MEM_MONITOR;
-    loop_tasks[0] = task;
-    loop_num_args[0] = 1;
-
-    loop_task_intervals[0] = MEM_INTERVAL;
-    loop_delay = fmin(loop_delay, MEM_INTERVAL);
-  } else if (task_quiet) {
-    task = TASK_QUIET;
-    loop_tasks[0] = task;
-    loop_num_args[0] = 1;
-
-    break_loop = true;
-  } else {
-    printf("Invalid task given!\n");
+
+    // a replay brings its own frames
+    if (replay_path == NULL &&
+        create_tasks(&dev->output, dev->args.size(), dev->args.data(), &tasks) != 0) {
+      return 1;
+    }
+
+    outputs.push_back(&dev->output);
+  }
+
+  if (record_path != NULL && open_recording(record_path, &io.loop) != 0) {
     return 1;
   }
 
-  if (task_display != NULL) {
-    if (!strcmp(task_display, "temps")) {
-      task = TASK_TEMPS;
+  // so that Ctrl-C while a board isn't answering still finishes cleanly
+  stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 
-      loop_tasks[1] = task;
-      loop_num_args[1] = 1;
-    } else if (!strcmp(task_display, "word")) {
-      if (argc < 4 + task2_offset) {
-	printf("Need to give a word!\n");
-	return 1;
-      }
+  signal(SIGINT, stop_running);
+  signal(SIGTERM, stop_running);
 
-      const char *word_str = argv[3 + task2_offset];
-      int word;
-
-      if (!strcmp(word_str, "aced")) {
-	word = WORD_ACED;
-      } else if (!strcmp(word_str, "beef")) {
-	word = WORD_BEEF;
-      } else if (!strcmp(word_str, "babe")) {
-	word = WORD_BABE;
-      } else if (!strcmp(word_str, "dead")) {
-	word = WORD_DEAD;
-      } else if (!strcmp(word_str, "deaf")) {
-	word = WORD_DEAF;
-      } else {
-	printf("Need to give a valid word!\n");
-	return 1;
-      }
+  // the boards take a couple of seconds to reset, so do them all at once
+  for (device *dev : devices) {
+    dev->handshake = std::thread(handshake, dev->writer, &dev->options, &dev->link);
+  }
+
+  for (device *dev : devices) {
+    dev->handshake.join();
+
+    start_writer(dev->writer);
+  }
 
-      task = TASK_WORD;
-      loop_tasks[1] = task;
-      loop_args[1][1] = word;
-      loop_num_args[1] = 2;
+  if (replay_path != NULL) {
+    // replays write to the devices themselves, without the I/O thread
+    if (replay_as_fast_as_possible) {
+      replay_fast(&replay);
+    }
+    else {
+      replay_realtime(&replay);
     }
   }
+  else {
+    start_io();
 
-  loop(
-    loop_tasks,
-    num_tasks,
-    loop_args,
-    loop_num_args,
-    loop_task_intervals,
-    loop_delay,
-    seq,
-    break_loop
-  );
+    if (start_sampler() != 0) {
+      return 1;
+    }
+
+    loop(tasks, outputs);
+
+    stop_sampler();
+    stop_io();
+  }
+
+  if (replay_path != NULL) {
+    printf(
+      "Replayed %ld of %ld records (%ld frames) from %s in %lld ms\n",
+      replay.next,
+      replay.num_records,
+      replay.frames,
+      replay_path,
+      (monotonic_us() - replay.started) / 1000
+    );
+
+    close_replay(&replay);
+  }
+  else {
+    for (int i = 0; i < NUM_METRICS; i++) {
+      print_timer_stats("Sampler", metrics[i].name, &metrics[i].stats);
+    }
+  }
+
+  if (record_path != NULL) {
+    printf("Recorded %ld frames to %s\n", recording.records - 1, record_path);
+
+    close_recording();
+  }
+
+  for (task *finished : tasks) {
+    delete finished;
+  }
+
+  for (device *dev : devices) {
+    print_writer_stats(dev->writer);
+  }
 
   return 0;
 }
+#endif